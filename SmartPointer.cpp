@@ -1,3 +1,31 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <cerrno>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#endif
+
 /**
 What are smart pointers? 
 The answer is fairly simple; a smart pointer is a pointer which is smart. 
@@ -11,23 +39,126 @@ A smart pointer is designed to handle the problems caused by using normal pointe
 class Person  //person class
 {
     int age;
-    char* pName;
+    char* pName;        // points at shortName, or at a copy on the heap for a long name
+    char shortName[24]; // most names fit here, so they need no allocation
+
+    void SetName(const char* pValue)
+    {
+        size_t size = pValue ? strlen(pValue) + 1 : 1;
+        pName = size <= sizeof(shortName) ? shortName : new char[size];
+        if (pValue)
+        {
+            memcpy(pName, pValue, size);
+        }
+        else
+        {
+            pName[0] = 0;
+        }
+    }
+
+    void FreeName()
+    {
+        if (pName != shortName)
+        {
+            delete[] pName;
+        }
+    }
+
+    static char* FormatInt(char* pOut, int value) //like %d, two digits per division
+    {
+        static const char pairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        char digits[12];
+        char* p = digits + sizeof(digits);
+        unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+        while (u >= 100)
+        {
+            unsigned int pair = (u % 100) * 2;
+            u /= 100;
+            *--p = pairs[pair + 1];
+            *--p = pairs[pair];
+        }
+        if (u >= 10)
+        {
+            *--p = pairs[u * 2 + 1];
+            *--p = pairs[u * 2];
+        }
+        else
+        {
+            *--p = (char)('0' + u);
+        }
+        if (value < 0)
+        {
+            *--p = '-';
+        }
+        size_t length = digits + sizeof(digits) - p;
+        memcpy(pOut, p, length);
+        return pOut + length;
+    }
 
     public:
-        Person(): pName(0),age(0) //constructor
+        Person(): age(0) //constructor
         {
+            SetName(0);
         }
-        Person(char* pName, int age): pName(pName), age(age)  //constructor
+        Person(const char* pName, int age): age(age)  //constructor
         {
+            SetName(pName);
+        }
+        Person(const Person& person): age(person.age)  //copy constructor, pName must not point into person
+        {
+            SetName(person.pName);
+        }
+        Person& operator = (const Person& person)
+        {
+            if (this != &person)
+            {
+                // allocate the new name before freeing ours, if new throws this person is unchanged
+                size_t size = strlen(person.pName) + 1;
+                char* pCopy = size <= sizeof(shortName) ? shortName : new char[size];
+                FreeName();
+                pName = pCopy;
+                memcpy(pName, person.pName, size);
+                age = person.age;
+            }
+            return *this;
         }
         ~Person()  //destructor
         {
+            FreeName();
         }
 
+        const char* Name() const //valid until the name is assigned again
+        {
+            return pName;
+        }
+        int& Age()
+        {
+            return age;
+        }
         void Display()
         {
             printf("Name = %s Age = %d \n", pName, age);
         }
+        size_t FormatSize() const //upper bound of what Format writes
+        {
+            return strlen(pName) + 27;
+        }
+        size_t Format(char* pBuffer) const //the same text as Display, returns its length
+        {
+            char* p = pBuffer;
+            memcpy(p, "Name = ", 7);
+            p += 7;
+            size_t length = strlen(pName);
+            memcpy(p, pName, length);
+            p += length;
+            memcpy(p, " Age = ", 7);
+            p = FormatInt(p + 7, age);
+            memcpy(p, " \n", 2);
+            return p + 2 - pBuffer;
+        }
         void Shout()
         {
             printf("Ooooooooooooooooo",);
@@ -166,8 +297,13 @@ class RC
 {
     private:
     int count; // Reference count
+    int weak;  // Weak reference count, +1 as long as count is not zero (see WeakSP)
 
     public:
+    RC() : count(0), weak(1)
+    {
+    }
+
     void AddRef()
     {
         // Increment the reference count
@@ -180,6 +316,309 @@ class RC
         // return the reference count.
         return --count;
     }
+
+    bool AddRefIfAlive()
+    {
+        // Increment the reference count unless it already reached zero
+        if (count == 0)
+        {
+            return false;
+        }
+        count++;
+        return true;
+    }
+
+    void AddWeak()
+    {
+        weak++;
+    }
+
+    int ReleaseWeak()
+    {
+        return --weak;
+    }
+
+    int Count() const
+    {
+        return count;
+    }
+};
+
+//Instrumentation
+/**
+To find out which types make and destroy the most control blocks, 
+build with SP_INSTRUMENT defined. Every type T then has its SPStats: 
+the control blocks made for it, the AddRef and Release calls of its smart pointers, 
+how many of its objects are alive and the most that ever were, 
+and a histogram of how long destroying one took (bucket i counts the times below 2^i ns). 
+SPStats::SnapshotAll() returns the counters of every type used so far. 
+Each counter is exact, but they are read one after the other while the program goes on. 
+
+The hooks are the SP_STATS_ macros in the control blocks and in SP. 
+Without SP_INSTRUMENT they expand to nothing, so the normal build does not pay anything for them, 
+not even a byte in SP or in a control block. 
+The blocks count births and deaths, so they are right whoever releases the last reference 
+(BiasedRC's MergeQueued as well), the smart pointers count the AddRef and Release calls. 
+An array is counted under its element type: SP<Person[]>, its block and the SP<Person> 
+from Element(i) which share that block all count under Person. 
+Intrusive pointers and the AtomicSP box are not counted.
+*/
+#ifdef SP_INSTRUMENT
+static const int SPStatsBuckets = 32;
+
+struct SPStatsSnapshot
+{
+    const char* pType;  // typeid(T).name()
+    long long blocks;   // control blocks created
+    long long addRefs;
+    long long releases;
+    long long live;     // objects not destroyed yet
+    long long peak;     // most live objects at one time
+    long long latency[SPStatsBuckets]; // destructions by time taken
+};
+
+class SPStats //the counters of one type
+{
+    private:
+    const char* pType;
+    std::atomic<long long> blocks;
+    std::atomic<long long> addRefs;
+    std::atomic<long long> releases;
+    std::atomic<long long> live;
+    std::atomic<long long> peak;
+    std::atomic<long long> latency[SPStatsBuckets];
+    SPStats* next; // every SPStats is on one list, for SnapshotAll
+
+    static std::atomic<SPStats*>& Head()
+    {
+        static std::atomic<SPStats*> head(0);
+        return head;
+    }
+
+    SPStats(const char* pName) : pType(pName), blocks(0), addRefs(0), releases(0), live(0), peak(0)
+    {
+        for (int i = 0; i < SPStatsBuckets; i++)
+        {
+            latency[i].store(0, std::memory_order_relaxed);
+        }
+        next = Head().load(std::memory_order_relaxed);
+        while (!Head().compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    public:
+    template < typename T > static SPStats& Of()
+    {
+        static SPStats* stats = new SPStats(typeid(T).name()); // never deleted, it stays on the list
+        return *stats;
+    }
+
+    void Block()
+    {
+        blocks.fetch_add(1, std::memory_order_relaxed);
+        long long now = live.fetch_add(1, std::memory_order_relaxed) + 1;
+        long long top = peak.load(std::memory_order_relaxed);
+        while (now > top && !peak.compare_exchange_weak(top, now, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void AddRef()
+    {
+        addRefs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Release()
+    {
+        releases.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Destroyed(long long ns)
+    {
+        live.fetch_sub(1, std::memory_order_relaxed);
+        int bucket = 0;
+        while (bucket < SPStatsBuckets - 1 && (1LL << bucket) <= ns)
+        {
+            bucket++;
+        }
+        latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SPStatsSnapshot Snapshot() const
+    {
+        SPStatsSnapshot snapshot;
+        snapshot.pType = pType;
+        snapshot.blocks = blocks.load(std::memory_order_relaxed);
+        snapshot.addRefs = addRefs.load(std::memory_order_relaxed);
+        snapshot.releases = releases.load(std::memory_order_relaxed);
+        snapshot.live = live.load(std::memory_order_relaxed);
+        snapshot.peak = peak.load(std::memory_order_relaxed);
+        for (int i = 0; i < SPStatsBuckets; i++)
+        {
+            snapshot.latency[i] = latency[i].load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    static std::vector<SPStatsSnapshot> SnapshotAll()
+    {
+        std::vector<SPStatsSnapshot> all;
+        for (SPStats* stats = Head().load(std::memory_order_acquire); stats; stats = stats->next)
+        {
+            all.push_back(stats->Snapshot());
+        }
+        return all;
+    }
+};
+
+template < typename T > class SPStatsTimer //times a destruction, from its constructor to its destructor
+{
+    private:
+    std::chrono::steady_clock::time_point start;
+
+    public:
+    SPStatsTimer() : start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~SPStatsTimer()
+    {
+        SPStats::Of<T>().Destroyed(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+#define SP_STATS_BLOCK(T) SPStats::Of<T>().Block()
+#define SP_STATS_ADDREF(T) SPStats::Of<T>().AddRef()
+#define SP_STATS_RELEASE(T) SPStats::Of<T>().Release()
+#define SP_STATS_DESTROY(T) SPStatsTimer<T> spStatsTimer
+#else
+#define SP_STATS_BLOCK(T) ((void)0)
+#define SP_STATS_ADDREF(T) ((void)0)
+#define SP_STATS_RELEASE(T) ((void)0)
+#define SP_STATS_DESTROY(T) ((void)0)
+#endif
+
+//Control block classes
+/**
+SP does not hold the RC directly but a control block: the counting class plus the knowledge 
+of how to destroy the object once the count reaches zero. 
+RCPointer is used by SP(new T(...)), it keeps the pointer and deletes it with its deleter. 
+RCInplace is used by make_SP (see below), it keeps the object inside the block itself. 
+RCAllocated turns either of them into a block which is allocated and freed by an allocator.
+A block tells its counting class how it is deleted with BindBlock, which does nothing for 
+most of them (BiasedRC below needs it).
+*/
+template < typename R > class RCBlock;
+
+template < typename R > void BindBlock(RCBlock<R>*, const void*) //the count never deletes on its own
+{
+}
+
+template < typename R > class RCBlock : public R
+{
+    public:
+    RCBlock()
+    {
+        BindBlock(this, this);
+    }
+
+    virtual ~RCBlock()
+    {
+    }
+
+    virtual void Dispose() = 0; // destroy the object
+
+    virtual void Destroy() // free the block itself, once the weak count reaches zero as well
+    {
+        delete this;
+    }
+};
+
+template < typename T > struct DefaultDeleter //what SP does with the pointer unless told otherwise
+{
+    void operator() (T* pValue) const
+    {
+        delete pValue;
+    }
+};
+
+template < typename T, typename R, typename D = DefaultDeleter<T> > class RCPointer : public RCBlock<R>
+{
+    private:
+    T* pData;  // object allocated by the caller
+    D deleter; // kept in the block, so a custom deleter does not make SP any bigger
+
+    public:
+    RCPointer(T* pValue, const D& d = D()) : pData(pValue), deleter(d)
+    {
+        SP_STATS_BLOCK(T);
+    }
+
+    void Dispose()
+    {
+        SP_STATS_DESTROY(T);
+        deleter(pData);
+    }
+};
+
+template < typename T, typename R > class RCInplace : public RCBlock<R>
+{
+    private:
+    alignas(T) unsigned char storage[sizeof(T)]; // the object, right behind the count
+
+    public:
+    template < typename... Args > RCInplace(Args&&... args)
+    {
+        new (storage) T(std::forward<Args>(args)...);
+        SP_STATS_BLOCK(T);
+    }
+
+    T* Get()
+    {
+        return std::launder(reinterpret_cast<T*>(storage));
+    }
+
+    void Dispose()
+    {
+        SP_STATS_DESTROY(T);
+        Get()->~T();
+    }
+};
+
+template < typename Block, typename A > class RCAllocated : public Block
+{
+    private:
+    typedef typename std::allocator_traits<A>::template rebind_alloc< RCAllocated<Block, A> > BlockAllocator;
+    BlockAllocator allocator; // the block frees itself with a copy of the allocator it came from
+
+    public:
+    template < typename... Args > RCAllocated(const A& a, Args&&... args) : Block(std::forward<Args>(args)...), allocator(a)
+    {
+    }
+
+    template < typename... Args > static RCAllocated<Block, A>* Create(const A& a, Args&&... args)
+    {
+        BlockAllocator blockAllocator(a);
+        RCAllocated<Block, A>* block = std::allocator_traits<BlockAllocator>::allocate(blockAllocator, 1);
+        try
+        {
+            new (static_cast<void*>(block)) RCAllocated<Block, A>(a, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            std::allocator_traits<BlockAllocator>::deallocate(blockAllocator, block, 1);
+            throw;
+        }
+        return block;
+    }
+
+    void Destroy()
+    {
+        BlockAllocator blockAllocator(allocator);
+        this->~RCAllocated();
+        std::allocator_traits<BlockAllocator>::deallocate(blockAllocator, this, 1);
+    }
 };
 
 /**
@@ -188,36 +627,146 @@ We will maintain a pointer to class RC in our SP class and this pointer will be
 all instances of the smart pointer which refers to the same pointer. For this to happen, 
 we need to have an assignment operator and copy constructor in our SP class.
 */
-template < typename T > class SP
+template < typename T, typename R > class WeakSP;
+template < typename T, typename R > class SPRef;
+template < typename T, typename R > class AtomicSP;
+template < typename T, typename R > class UniqueSP;
+
+template < typename T, typename R = RC > class SP  //R is the counting policy, RC by default
 {
 private:
     T*    pData;       // pointer
-    RC* reference; // Reference count, hold a pointer to RC, so can shared RC through all pointer objects
+    RCBlock<R>* reference; // Reference count, hold a pointer to the control block, so can shared it through all pointer objects
+
+    void ReleaseReference() //drop our reference, delete the data if it was the last one
+    {
+        if (reference)
+        {
+            SP_STATS_RELEASE(T);
+        }
+        if (reference && reference->Release() == 0)
+        {
+            reference->Dispose();
+            // all the strong references together hold one weak reference,
+            // the block stays until the last WeakSP is gone too
+            if (reference->ReleaseWeak() == 0)
+            {
+                reference->Destroy();
+            }
+        }
+    }
+
+    template < typename U, typename Q > friend class SP;
+    template < typename U, typename Q > friend class WeakSP;
+    template < typename U, typename Q > friend class SPRef;
+    template < typename U, typename Q > friend class AtomicSP;
+    template < typename U, typename Q > friend class UniqueSP;
 
 public:
     SP() : pData(0), reference(0)  //default constructor
     {
-        // Create a new reference 
-        reference = new RC();
-        // Increment the reference count
-        reference->AddRef();
+        // Empty pointer, there is nothing to count
+        // so no reference is created
     }
 
     SP(T* pValue) : pData(pValue), reference(0) //constructor with specified T
     {
-        // Create a new reference 
-        reference = new RC();
+        if (pData) // SP(0) is empty as well
+        {
+            // Create a new reference, 
+            // we own pValue already, so it must not leak if there is no memory for the block
+            try
+            {
+                reference = new RCPointer<T, R>(pData);
+            }
+            catch (...)
+            {
+                delete pValue;
+                throw;
+            }
+            // Increment the reference count
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    template < typename D > SP(T* pValue, D deleter) : pData(pValue), reference(0) //constructor with a custom deleter
+    {
+        if (pData)
+        {
+            try
+            {
+                reference = new RCPointer<T, R, D>(pData, deleter);
+            }
+            catch (...)
+            {
+                deleter(pValue);
+                throw;
+            }
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    template < typename D, typename A > SP(T* pValue, D deleter, const A& allocator) : pData(pValue), reference(0) //the block is allocated with allocator
+    {
+        if (pData)
+        {
+            try
+            {
+                reference = RCAllocated<RCPointer<T, R, D>, A>::Create(allocator, pData, deleter);
+            }
+            catch (...)
+            {
+                deleter(pValue);
+                throw;
+            }
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    SP(T* pValue, RCBlock<R>* block) : pData(pValue), reference(block) //used by make_SP, the block already holds the data
+    {
         // Increment the reference count
         reference->AddRef();
+        SP_STATS_ADDREF(T);
+    }
+
+    template < typename U > SP(const SP<U, R>& owner, T* pValue) : pData(0), reference(owner.reference) //aliasing constructor
+    {
+        // Point at pValue (a member of the owner's data, say)
+        // but share the owner's reference, so the owner lives as long as we do
+        // (an empty owner gives an empty pointer)
+        if (reference)
+        {
+            pData = pValue;
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
     }
 
     //Copy constructor
-    SP(const SP<T>& sp) : pData(sp.pData), reference(sp.reference)
+    SP(const SP<T, R>& sp) : pData(sp.pData), reference(sp.reference)
     {
         // Copy constructor
         // Copy the data and reference pointer
-        // and increment the reference count
-        reference->AddRef();
+        // and increment the reference count (if sp is not empty)
+        if (reference)
+        {
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    //Move constructor
+    SP(SP<T, R>&& sp) noexcept : pData(sp.pData), reference(sp.reference)
+    {
+        // Take over the data and reference pointer of sp,
+        // the reference count does not change
+        // and sp is left empty
+        sp.pData = 0;
+        sp.reference = 0;
     }
 
     ~SP()  //Destructor
@@ -225,46 +774,78 @@ public:
         // Destructor
         // Decrement the reference count
         // if reference become zero delete the data
-        if(reference->Release() == 0)
-        {
-            delete pData;
-            delete reference;
-        }
+        // (a moved-from pointer has no reference)
+        ReleaseReference();
     }
 
-    T& operator* ()
+    T& operator* () const
     {
         return *pData;
     }
 
-    T* operator-> ()
+    T* operator-> () const
     {
         return pData;
     }
-    
-    SP<T>& operator = (const SP<T>& sp) //override operator =, copy assignment action (r=p)
+
+    explicit operator bool () const //if (p) ..., false for an empty pointer
     {
-        // Assignment operator
-        if (this != &sp) // Avoid self assignment
-        {
-            // Decrement the old reference count
-            // if reference become zero delete the old data
-            if(reference->Release() == 0)
-            {
-                delete pData;
-                delete reference;
-            }
+        return pData != 0;
+    }
+
+    int use_count() const //number of SP sharing the data, 0 for an empty pointer
+    {
+        return reference ? reference->Count() : 0;
+    }
+
+    bool unique() const //the only SP to its data
+    {
+        return use_count() == 1;
+    }
+    
+    SP<T, R>& operator = (const SP<T, R>& sp) //override operator =, copy assignment action (r=p)
+    {
+        // Assignment operator
+        if (this != &sp) // Avoid self assignment
+        {
+            // Decrement the old reference count
+            // if reference become zero delete the old data
+            ReleaseReference();
 
             // Copy the data and reference pointer
-            // and increment the reference count
+            // and increment the reference count (if sp is not empty)
             pData = sp.pData;
             reference = sp.reference;
-            reference->AddRef();
+            if (reference)
+            {
+                reference->AddRef();
+                SP_STATS_ADDREF(T);
+            }
         }
         return *this;
     }
+
+    SP<T, R>& operator = (SP<T, R>&& sp) noexcept //move assignment action (r=std::move(p))
+    {
+        // Move sp into a temporary and swap it with this,
+        // the temporary takes our old data and releases it when it goes away
+        SP<T, R>(std::move(sp)).swap(*this);
+        return *this;
+    }
+
+    void swap(SP<T, R>& sp) noexcept
+    {
+        // Exchange the pointers, no reference count is touched
+        std::swap(pData, sp.pData);
+        std::swap(reference, sp.reference);
+    }
 };
 
+template < typename T, typename R > void swap(SP<T, R>& a, SP<T, R>& b) noexcept
+{
+    a.swap(b);
+}
+
 //Client code to use smart pointer with reference counting
 void main()
 {
@@ -297,3 +878,3506 @@ Here the reference count will be decremented, but data will not be deleted unles
 This happens only when the destructor of p is called. Hence our data will be deleted only when no body is referring to it.
 */
 
+
+//Thread-safe reference counting class
+/**
+RC uses a plain int, so when two threads copy or destroy smart pointers to the same object 
+at the same time, one of the ++/-- can be lost and the object is leaked or deleted twice. 
+AtomicRC has the same interface as RC but keeps the count in a std::atomic<int>, 
+and SP takes the counting class as its second template parameter: SP<Person, AtomicRC>.
+
+The increment only needs relaxed ordering: a new reference is always made from an existing one, 
+so the object is already alive and there is nothing to publish. 
+The decrement uses release ordering, so everything we did with the object happens before the count drops, 
+and the thread which takes the count to zero issues an acquire fence before it deletes the data. 
+RC stays the default, an atomic read-modify-write costs much more than a plain ++ or --, 
+and a pointer which never leaves its thread should not pay for it.
+*/
+class AtomicRC
+{
+    private:
+    std::atomic<int> count; // Reference count
+    std::atomic<int> weak;  // Weak reference count, +1 as long as count is not zero (see WeakSP)
+
+    public:
+    AtomicRC() : count(0), weak(1)
+    {
+    }
+
+    void AddRef()
+    {
+        // Increment the reference count
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int Release()
+    {
+        // Decrement the reference count and
+        // return the reference count.
+        int result = count.fetch_sub(1, std::memory_order_release) - 1;
+        if (result == 0)
+        {
+            // make the other threads' writes visible before the data is deleted
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return result;
+    }
+
+    bool AddRefIfAlive()
+    {
+        // Increment the reference count unless it already reached zero,
+        // another thread may be releasing the last reference at the same time
+        int current = count.load(std::memory_order_relaxed);
+        while (current != 0)
+        {
+            if (count.compare_exchange_weak(current, current + 1, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void AddWeak()
+    {
+        weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int ReleaseWeak()
+    {
+        int result = weak.fetch_sub(1, std::memory_order_release) - 1;
+        if (result == 0)
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return result;
+    }
+
+    int Count() const
+    {
+        // acquire, so a caller which sees 1 also sees what the released references did
+        return count.load(std::memory_order_acquire);
+    }
+};
+
+//Client code to share a smart pointer between threads
+void main()
+{
+    SP<Person, AtomicRC> p(new Person("Scott", 25));
+    std::thread workers[4];
+    for (int i = 0; i < 4; i++)
+    {
+        workers[i] = std::thread([p]() //every thread gets its own copy of p
+        {
+            for (int j = 0; j < 1000000; j++)
+            {
+                SP<Person, AtomicRC> q = p; //copy constructor, count is incremented atomically
+                // Destructor of q will be called here..
+            }
+        });
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        workers[i].join();
+    }
+    p->Display();
+    // Destructor of p will be called here 
+    // and person pointer will be deleted
+}
+
+//Creating the object and its reference count together
+/**
+SP<Person> p(new Person("Scott", 25)); does two allocations: 
+new Person in the client code and new RCPointer in the constructor of SP. 
+The two blocks usually end up in different places of the heap, 
+so using p (count and data) touches two cache lines. 
+make_SP builds the person inside a single RCInplace block, right behind its count: 
+one allocation, one deallocation, and the count and the data are next to each other. 
+The arguments of make_SP are forwarded to the constructor of T.
+*/
+template < typename T, typename R = RC, typename... Args > SP<T, R> make_SP(Args&&... args)
+{
+    RCInplace<T, R>* block = new RCInplace<T, R>(std::forward<Args>(args)...);
+    return SP<T, R>(block->Get(), static_cast<RCBlock<R>*>(block)); //not the deleter constructor
+}
+
+//Client code to use make_SP
+void main()
+{
+    SP<Person> p = make_SP<Person>("Scott", 25); //only one allocation
+    p->Display();
+    {
+        SP<Person> q = p; //copy constructor called, q shares the same block
+        q->Display();
+        // Destructor of q will be called here..
+    }
+    SP<Person, AtomicRC> t = make_SP<Person, AtomicRC>("Tom", 30); //works with every counting class
+    t->Display();
+    // Destructors of t and p will be called here 
+    // and the blocks (count and person) will be deleted at once
+}
+
+//Moving smart pointers
+/**
+Returning an SP from a function or storing it in a container used to call the copy constructor 
+and then the destructor of the original: one AddRef and one Release for nothing, 
+and with AtomicRC two atomic operations on a shared cache line. 
+The move constructor and move assignment take over pData and reference from the source 
+and leave it empty, the count is not touched at all. 
+They are noexcept, so std::vector moves its SPs when it grows instead of copying them. 
+swap exchanges two pointers the same way.
+*/
+SP<Person> CreatePerson(const char* pName, int age)
+{
+    SP<Person> p = make_SP<Person>(pName, age);
+    return p; //moved out, no reference count change
+}
+
+//Client code to move smart pointers
+void main()
+{
+    std::vector< SP<Person> > people;
+    people.push_back(CreatePerson("Scott", 25)); //move constructor called
+    people.push_back(CreatePerson("Tom", 30));   //vector grows, the first SP is moved, not copied
+
+    SP<Person> p = std::move(people[0]); //p takes Scott, people[0] is now empty
+    p->Display();
+
+    SP<Person> q = CreatePerson("Bob", 40);
+    swap(p, q); //p is Bob and q is Scott, counts are unchanged
+    p->Display();
+    q->Display();
+
+    people[0] = std::move(q); //move assignment called, Scott goes back into the vector
+    people[0]->Display();
+    // Destructors will be called here, the moved-from pointers do nothing
+}
+
+//Empty smart pointers
+/**
+SP<PERSON> r; in the client code above used to allocate an RC just to count a null pointer, 
+and then free it again when r = p; was executed. 
+Now an empty SP (default constructed, built from 0 or moved from) has no reference at all: 
+the constructors do not allocate, and the copy constructor, the assignment operators and the destructor 
+skip the count when there is no reference. 
+An empty SP converts to false, so it can be tested like a raw pointer.
+*/
+//Client code to use empty smart pointers
+void main()
+{
+    std::vector< SP<Person> > slots(1000); //1000 empty pointers, no allocation at all
+    slots[0] = make_SP<Person>("Scott", 25);
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (slots[i]) //skip the empty slots
+        {
+            slots[i]->Display();
+        }
+    }
+
+    SP<Person> r; //default constructor called, no reference created
+    SP<Person> s = r; //copying an empty pointer gives an empty pointer
+    r = slots[0]; //copy assignment called, r now shares Scott
+    r->Display();
+    // Destructors will be called here, only Scott's block is deleted
+}
+
+//Intrusive reference counting
+/**
+SP is two pointers wide (data and reference) and the count lives in a separate block. 
+For a type we own, like Person, the count can live inside the object instead: 
+the class derives from RefCounted, which is just the counting class, 
+and IntrusiveSP holds only the pointer to the object and calls AddRef and Release on it. 
+The handle is half the size of an SP and there is no control block to allocate. 
+Any counting class can be used, RefCounted<AtomicRC> for objects shared between threads. 
+IntrusiveSP tells the count how its object is deleted with BindIntrusive, like RCBlock does with BindBlock.
+*/
+template < typename R = RC > class RefCounted : public R
+{
+    protected:
+    RefCounted()
+    {
+    }
+
+    RefCounted(const RefCounted<R>&) : R() //a copy of the object is not referenced by anybody yet
+    {
+    }
+
+    RefCounted<R>& operator = (const RefCounted<R>&) //assigning the object keeps its own count
+    {
+        return *this;
+    }
+
+    ~RefCounted() //the object is deleted through its own type, so no virtual destructor
+    {
+    }
+};
+
+template < typename T > void BindIntrusive(T*, const void*) //the count never deletes on its own
+{
+}
+
+template < typename T > class IntrusiveSP
+{
+private:
+    T*    pData; // pointer, the object holds its own reference count
+
+public:
+    IntrusiveSP() : pData(0)
+    {
+    }
+
+    IntrusiveSP(T* pValue) : pData(pValue)
+    {
+        if (pData)
+        {
+            BindIntrusive(pData, pData);
+            pData->AddRef();
+        }
+    }
+
+    IntrusiveSP(const IntrusiveSP<T>& sp) : pData(sp.pData)
+    {
+        if (pData)
+        {
+            pData->AddRef();
+        }
+    }
+
+    IntrusiveSP(IntrusiveSP<T>&& sp) noexcept : pData(sp.pData)
+    {
+        sp.pData = 0;
+    }
+
+    ~IntrusiveSP()
+    {
+        // if reference become zero delete the data
+        if (pData && pData->Release() == 0)
+        {
+            delete pData;
+        }
+    }
+
+    T& operator* ()
+    {
+        return *pData;
+    }
+
+    T* operator-> ()
+    {
+        return pData;
+    }
+
+    explicit operator bool () const
+    {
+        return pData != 0;
+    }
+
+    IntrusiveSP<T>& operator = (const IntrusiveSP<T>& sp)
+    {
+        // Copy sp into a temporary and swap it with this,
+        // which also handles self assignment
+        IntrusiveSP<T>(sp).swap(*this);
+        return *this;
+    }
+
+    IntrusiveSP<T>& operator = (IntrusiveSP<T>&& sp) noexcept
+    {
+        IntrusiveSP<T>(std::move(sp)).swap(*this);
+        return *this;
+    }
+
+    void swap(IntrusiveSP<T>& sp) noexcept
+    {
+        std::swap(pData, sp.pData);
+    }
+};
+
+template < typename T > void swap(IntrusiveSP<T>& a, IntrusiveSP<T>& b) noexcept
+{
+    a.swap(b);
+}
+
+//a person which carries its own thread-safe reference count
+class SharedPerson : public Person, public RefCounted<AtomicRC>
+{
+    public:
+    SharedPerson(const char* pName, int age) : Person(pName, age)
+    {
+    }
+};
+
+//Client code to use intrusive smart pointer
+void main()
+{
+    IntrusiveSP<SharedPerson> p(new SharedPerson("Scott", 25)); //one allocation, the count is inside the person
+    p->Display();
+    {
+        IntrusiveSP<SharedPerson> q = p; //count of the person goes to 2
+        q->Display();
+        // Destructor of q will be called here..
+    }
+    // sizeof(p) == sizeof(SharedPerson*), half of sizeof(SP<Person>)
+    p->Display();
+    // Destructor of p will be called here 
+    // and person pointer will be deleted
+}
+
+//Weak references
+/**
+A cache which holds SP<Person> keeps every person alive, even when nobody else uses it any more, 
+and two objects holding an SP to each other are never deleted. 
+WeakSP refers to the same control block without owning the object: 
+it counts in the separate weak count of the block, and lock() gives an SP 
+if the object is still alive or an empty SP if it is already deleted. 
+The object is deleted when the last SP goes away, the block (with the count) 
+when the last WeakSP goes away too. For a make_SP block that means its memory 
+is kept until then, even though the object in it is already destroyed.
+*/
+template < typename T, typename R = RC > class WeakSP
+{
+private:
+    T*    pData;       // pointer, only valid while the count is not zero
+    RCBlock<R>* reference; // control block shared with the SPs
+
+    void ReleaseWeakReference()
+    {
+        if (reference && reference->ReleaseWeak() == 0)
+        {
+            reference->Destroy();
+        }
+    }
+
+public:
+    WeakSP() : pData(0), reference(0)
+    {
+    }
+
+    WeakSP(const SP<T, R>& sp) : pData(sp.pData), reference(sp.reference)
+    {
+        if (reference)
+        {
+            reference->AddWeak();
+        }
+    }
+
+    WeakSP(const WeakSP<T, R>& wp) : pData(wp.pData), reference(wp.reference)
+    {
+        if (reference)
+        {
+            reference->AddWeak();
+        }
+    }
+
+    WeakSP(WeakSP<T, R>&& wp) noexcept : pData(wp.pData), reference(wp.reference)
+    {
+        wp.pData = 0;
+        wp.reference = 0;
+    }
+
+    ~WeakSP()
+    {
+        ReleaseWeakReference();
+    }
+
+    WeakSP<T, R>& operator = (const WeakSP<T, R>& wp)
+    {
+        WeakSP<T, R>(wp).swap(*this);
+        return *this;
+    }
+
+    WeakSP<T, R>& operator = (WeakSP<T, R>&& wp) noexcept
+    {
+        WeakSP<T, R>(std::move(wp)).swap(*this);
+        return *this;
+    }
+
+    WeakSP<T, R>& operator = (const SP<T, R>& sp)
+    {
+        WeakSP<T, R>(sp).swap(*this);
+        return *this;
+    }
+
+    void swap(WeakSP<T, R>& wp) noexcept
+    {
+        std::swap(pData, wp.pData);
+        std::swap(reference, wp.reference);
+    }
+
+    SP<T, R> lock() const
+    {
+        // Take a strong reference if the object is still alive
+        SP<T, R> sp;
+        if (reference && reference->AddRefIfAlive())
+        {
+            SP_STATS_ADDREF(T);
+            sp.pData = pData;
+            sp.reference = reference;
+        }
+        return sp;
+    }
+
+    bool expired() const //only reads the count, lock() would AddRef and Release it
+    {
+        return reference == 0 || reference->Count() == 0;
+    }
+};
+
+//Client code to use weak smart pointer
+void main()
+{
+    WeakSP<Person> cached;
+    {
+        SP<Person> p = make_SP<Person>("Scott", 25);
+        cached = p; //the cache does not keep Scott alive
+        SP<Person> q = cached.lock(); //Scott is alive, q is a new strong reference
+        q->Display();
+        // Destructors of q and p will be called here and Scott is deleted
+    }
+    if (!cached.lock())
+    {
+        printf("Scott is gone \n");
+    }
+    // Destructor of cached will be called here and the block is deleted
+}
+
+//Custom deleters and allocators
+/**
+So far SP always deletes the object with delete and its block with delete, 
+which ties everything to the global heap. 
+SP(p, deleter) keeps the deleter in the control block and calls it instead of delete, 
+SP(p, deleter, allocator) allocates the control block itself from the allocator as well, 
+and allocate_SP is make_SP with an allocator: object and count in one block taken from the allocator. 
+The deleter and the allocator are stored in the block, so SP stays two pointers wide, 
+and with the default deleter nothing changes at all. 
+Any standard allocator works, it is rebound to the type of the block.
+*/
+template < typename T, typename R = RC, typename A, typename... Args > SP<T, R> allocate_SP(const A& allocator, Args&&... args)
+{
+    RCAllocated<RCInplace<T, R>, A>* block = RCAllocated<RCInplace<T, R>, A>::Create(allocator, std::forward<Args>(args)...);
+    return SP<T, R>(block->Get(), static_cast<RCBlock<R>*>(block));
+}
+
+//an allocator which takes its memory from malloc instead of new
+template < typename T > struct MallocAllocator
+{
+    typedef T value_type;
+
+    MallocAllocator()
+    {
+    }
+
+    template < typename U > MallocAllocator(const MallocAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        void* p = malloc(n * sizeof(T));
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        free(p);
+    }
+};
+
+template < typename T, typename U > bool operator == (const MallocAllocator<T>&, const MallocAllocator<U>&)
+{
+    return true;
+}
+
+template < typename T, typename U > bool operator != (const MallocAllocator<T>&, const MallocAllocator<U>&)
+{
+    return false;
+}
+
+//a deleter for persons which were built in malloc'ed memory
+struct FreePerson
+{
+    void operator() (Person* pPerson) const
+    {
+        pPerson->~Person();
+        free(pPerson);
+    }
+};
+
+//Client code to use custom deleters and allocators
+void main()
+{
+    Person* pPerson = new (malloc(sizeof(Person))) Person("Scott", 25);
+    SP<Person> p(pPerson, FreePerson()); //FreePerson is called instead of delete
+    p->Display();
+
+    SP<Person> q(new Person("Tom", 30), DefaultDeleter<Person>(), MallocAllocator<Person>()); //block from malloc
+    q->Display();
+
+    SP<Person> r = allocate_SP<Person>(MallocAllocator<Person>(), "Bob", 40); //person and count from malloc
+    r->Display();
+    // Destructors will be called here, every block is freed the way it was allocated
+}
+
+//Displaying many persons at once
+/**
+Display calls printf once per person, which locks stdout and parses the format every time. 
+DisplayBatch formats as many persons as fit into one buffer given by the caller 
+(with the same bytes as Display) and writes every full buffer with a single write. 
+It works with anything that has -> to a Person: Person*, SP<Person>, IntrusiveSP<SharedPerson>... 
+The buffer must hold at least one person, call fflush(stdout) first when mixing it with printf.
+*/
+template < typename P > bool DisplayBatch(P* people, size_t count, char* pBuffer, size_t size, int fd = 1)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t used = 0;
+        size_t first = i;
+        while (i < count && used + people[i]->FormatSize() <= size)
+        {
+            used += people[i]->Format(pBuffer + used);
+            i++;
+        }
+        if (i == first)
+        {
+            return false; // the buffer cannot hold even one person
+        }
+        const char* p = pBuffer;
+        while (used > 0)
+        {
+            ssize_t written = write(fd, p, used);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            p += written;
+            used -= written;
+        }
+    }
+    return true;
+}
+
+//Client code to display many persons with one write
+void main()
+{
+    std::vector< SP<Person> > people;
+    people.push_back(make_SP<Person>("Scott", 25));
+    people.push_back(make_SP<Person>("Tom", 30));
+    people.push_back(make_SP<Person>("Bob", 40));
+
+    char buffer[4096];
+    fflush(stdout);
+    DisplayBatch(&people[0], people.size(), buffer, sizeof(buffer)); //same output as three Display calls
+}
+
+//Pooling control blocks
+/**
+Even with make_SP every person is a new and a delete of a block of the same size, 
+and with many threads they all fight over the global heap. 
+BlockPool keeps freed blocks of one size in a free list per thread and hands them out again: 
+allocating and freeing on the same thread is a pointer swap with no lock and no atomic. 
+A block freed by another thread is pushed on the owning thread's remote list with a 
+compare-exchange, the owner takes the whole remote list at once when its own list is empty. 
+Blocks come from 64KB slabs aligned to their size, so the owner of a block 
+is found from its address. The memory is kept for the life of the process. 
+A slab belongs to a ThreadCache, not to a thread: when a thread exits its cache goes on a list 
+of idle caches with its free blocks and its remote list, and the next thread which uses the pool 
+adopts it instead of making a new one. So there are never more caches than threads alive at once, 
+and blocks given back to a thread which has exited are reused by the thread which took its cache. 
+A thread_local destructor which runs after the cache was given back still works: 
+it frees to the remote list and borrows an idle cache to allocate. 
+PoolAllocator is a standard allocator over BlockPool, so it plugs into allocate_SP 
+and SP(p, deleter, allocator), and PoolDeleter gives a pooled object back.
+*/
+template < size_t Size, size_t Align > class BlockPool
+{
+    private:
+    struct Node
+    {
+        Node* next;
+    };
+
+    struct ThreadCache
+    {
+        Node* local;                // only used by the thread which has the cache
+        alignas(64) std::atomic<Node*> remote;  // pushed by other threads, on a cache line of its own
+        ThreadCache* nextIdle;      // on the idle list while no thread has it
+
+        ThreadCache() : local(0), remote(0), nextIdle(0)
+        {
+        }
+    };
+
+    struct IdleCaches //caches of threads which have exited, waiting for a new thread
+    {
+        std::mutex lock; // taken when a thread starts or exits, never on Allocate or Free
+        ThreadCache* head;
+
+        IdleCaches() : head(0)
+        {
+        }
+    };
+
+    struct CacheOwner //gives the thread's cache back when the thread exits
+    {
+        ~CacheOwner()
+        {
+            GiveBack(Current());
+            Current() = Exited();
+        }
+    };
+
+    struct Slab
+    {
+        ThreadCache* owner;
+    };
+
+    static const size_t SlabSize = 64 * 1024;
+    static const size_t SlotAlign = Align > alignof(Node) ? Align : alignof(Node);
+    static const size_t SlotSize = ((Size > sizeof(Node) ? Size : sizeof(Node)) + SlotAlign - 1) / SlotAlign * SlotAlign;
+    static const size_t FirstSlot = (sizeof(Slab) + SlotAlign - 1) / SlotAlign * SlotAlign;
+    static_assert(FirstSlot + SlotSize * 8 <= SlabSize, "block too big for BlockPool");
+
+    static IdleCaches& Idle()
+    {
+        static IdleCaches* idle = new IdleCaches(); // one for the process, threads may exit during static destruction
+        return *idle;
+    }
+
+    static ThreadCache* Exited() //the thread has given its cache back
+    {
+        static ThreadCache exited;
+        return &exited;
+    }
+
+    static ThreadCache*& Current()
+    {
+        // a plain pointer, so it is still there while the other thread_local objects are destroyed
+        static thread_local ThreadCache* current = 0;
+        return current;
+    }
+
+    static ThreadCache* Adopt()
+    {
+        IdleCaches& idle = Idle();
+        std::lock_guard<std::mutex> hold(idle.lock);
+        ThreadCache* cache = idle.head;
+        if (!cache)
+        {
+            return new ThreadCache();
+        }
+        idle.head = cache->nextIdle;
+        return cache;
+    }
+
+    static void GiveBack(ThreadCache* cache)
+    {
+        IdleCaches& idle = Idle();
+        std::lock_guard<std::mutex> hold(idle.lock);
+        cache->nextIdle = idle.head;
+        idle.head = cache;
+    }
+
+    static ThreadCache* Cache()
+    {
+        ThreadCache* cache = Current();
+        if (!cache)
+        {
+            static thread_local CacheOwner owner; // constructed here, so its destructor runs at thread exit
+            (void)owner;
+            cache = Current() = Adopt();
+        }
+        return cache;
+    }
+
+    static void Refill(ThreadCache& cache)
+    {
+        char* slab = static_cast<char*>(::operator new(SlabSize, std::align_val_t(SlabSize)));
+        reinterpret_cast<Slab*>(slab)->owner = &cache;
+        for (size_t offset = FirstSlot; offset + SlotSize <= SlabSize; offset += SlotSize)
+        {
+            Node* node = reinterpret_cast<Node*>(slab + offset);
+            node->next = cache.local;
+            cache.local = node;
+        }
+    }
+
+    static void* Take(ThreadCache& cache)
+    {
+        if (!cache.local)
+        {
+            cache.local = cache.remote.exchange(0, std::memory_order_acquire);
+            if (!cache.local)
+            {
+                Refill(cache);
+            }
+        }
+        Node* node = cache.local;
+        cache.local = node->next;
+        return node;
+    }
+
+    public:
+    static void* Allocate()
+    {
+        ThreadCache* cache = Cache();
+        if (cache == Exited())
+        {
+            // a thread_local destructor after CacheOwner's, borrow a cache for this one block
+            cache = Adopt();
+            void* p = Take(*cache);
+            GiveBack(cache);
+            return p;
+        }
+        return Take(*cache);
+    }
+
+    static void Free(void* p)
+    {
+        Node* node = static_cast<Node*>(p);
+        Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(SlabSize - 1));
+        if (slab->owner == Current()) // a thread which only frees does not need a cache of its own
+        {
+            node->next = slab->owner->local;
+            slab->owner->local = node;
+            return;
+        }
+        // another cache's block (always so before the thread has a cache and after it gave it back), push it on its remote list
+        node->next = slab->owner->remote.load(std::memory_order_relaxed);
+        while (!slab->owner->remote.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+};
+
+template < typename T > struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator()
+    {
+    }
+
+    template < typename U > PoolAllocator(const PoolAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (n != 1)
+        {
+            return static_cast<T*>(::operator new(n * sizeof(T))); //only single blocks are pooled
+        }
+        return static_cast<T*>(BlockPool<sizeof(T), alignof(T)>::Allocate());
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (n != 1)
+        {
+            ::operator delete(p);
+            return;
+        }
+        BlockPool<sizeof(T), alignof(T)>::Free(p);
+    }
+};
+
+template < typename T, typename U > bool operator == (const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return true;
+}
+
+template < typename T, typename U > bool operator != (const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return false;
+}
+
+template < typename T > struct PoolDeleter //for objects built in BlockPool memory
+{
+    void operator() (T* pValue) const
+    {
+        pValue->~T();
+        BlockPool<sizeof(T), alignof(T)>::Free(pValue);
+    }
+};
+
+//Client code to use pooled smart pointers
+void main()
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        //person and count in one pooled block, the same block is reused every time
+        SP<Person, AtomicRC> p = allocate_SP<Person, AtomicRC>(PoolAllocator<Person>(), "Scott", 25);
+    }
+
+    //person and control block pooled separately
+    Person* pPerson = new (BlockPool<sizeof(Person), alignof(Person)>::Allocate()) Person("Tom", 30);
+    SP<Person, AtomicRC> q(pPerson, PoolDeleter<Person>(), PoolAllocator<Person>());
+    std::thread worker([&q]()
+    {
+        SP<Person, AtomicRC> r = std::move(q); //the last reference dies on the worker thread,
+        r->Display();                          //so the blocks go back to this thread's remote lists
+    });
+    worker.join();
+    SP<Person, AtomicRC> t = allocate_SP<Person, AtomicRC>(PoolAllocator<Person>(), "Bob", 40);
+    t->Display();
+}
+
+//Deferred destruction
+/**
+When the last SP to a big object graph goes away, its destructor (and every destructor it triggers) 
+runs right there, on the thread which happened to drop the last reference. 
+DeferredDeleter does not delete the object, it puts it on a ReclaimQueue, 
+and the objects are deleted in batches later: by Drain() at a point where it does not hurt, 
+or by a background thread started with Start(). Whatever is still queued 
+is deleted when the queue itself is destroyed, including what those objects retire in their destructors, 
+so it must outlive its SPs, and no other thread may Retire while it is destroyed. 
+Only the object is deferred, the control block is freed as usual. It works with SP(p, deleter), 
+not with make_SP, whose object lives inside the control block.
+*/
+class ReclaimQueue
+{
+    private:
+    struct Retired
+    {
+        void* pObject;
+        void (*destroy)(void*);
+    };
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<Retired> pending;
+    std::thread background;
+    bool stopping;
+
+    public:
+    ReclaimQueue() : stopping(false)
+    {
+    }
+
+    ~ReclaimQueue() //nobody may Retire while the queue is destroyed, only the destructors it runs
+    {
+        Stop();
+        while (Drain() != 0) //what the deleted objects retire in their destructors is deleted too
+        {
+        }
+    }
+
+    void Retire(void* pObject, void (*destroy)(void*)) //called instead of delete
+    {
+        Retired retired = { pObject, destroy };
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back(retired);
+    }
+
+    size_t Drain() //delete everything queued so far, returns how many objects
+    {
+        std::vector<Retired> batch;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            batch.swap(pending);
+        }
+        // the destructors run outside the lock, they may retire more objects
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            batch[i].destroy(batch[i].pObject);
+        }
+        return batch.size();
+    }
+
+    void Start(std::chrono::milliseconds interval) //drain from a background thread every interval
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (background.joinable())
+        {
+            return;
+        }
+        stopping = false;
+        background = std::thread([this, interval]()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping)
+            {
+                wake.wait_for(guard, interval);
+                guard.unlock();
+                Drain();
+                guard.lock();
+            }
+        });
+    }
+
+    void Stop()
+    {
+        std::thread finished;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            finished.swap(background);
+        }
+        wake.notify_all();
+        if (finished.joinable())
+        {
+            finished.join();
+        }
+    }
+};
+
+template < typename T > struct DeferredDeleter
+{
+    ReclaimQueue* pQueue;
+
+    DeferredDeleter(ReclaimQueue& queue) : pQueue(&queue)
+    {
+    }
+
+    static void Destroy(void* pObject)
+    {
+        delete static_cast<T*>(pObject);
+    }
+
+    void operator() (T* pValue) const
+    {
+        pQueue->Retire(pValue, &DeferredDeleter<T>::Destroy);
+    }
+};
+
+//Client code to delete persons off the hot path
+void main()
+{
+    ReclaimQueue queue;
+    {
+        SP<Person> p(new Person("Scott", 25), DeferredDeleter<Person>(queue));
+        p->Display();
+        // Destructor of p will be called here, Scott is only queued
+    }
+    queue.Drain(); //Scott is deleted here, when we choose to
+
+    queue.Start(std::chrono::milliseconds(10)); //or let a background thread do it
+    for (int i = 0; i < 1000; i++)
+    {
+        SP<Person, AtomicRC> q(new Person("Tom", 30), DeferredDeleter<Person>(queue));
+    }
+    queue.Stop();
+    // Destructor of queue deletes whatever is left
+}
+
+//Borrowing a smart pointer
+/**
+A helper which takes SP<Person> by value copies it on the way in and destroys it on the way out: 
+an AddRef and a Release for a call which only looks at the person. 
+SPRef borrows the pointer instead. It is made from an SP without touching the count, 
+gives -> and * like the SP, and Retain() turns it into a real SP when the callee 
+wants to keep the object after returning. An SPRef must not outlive the SP it was made from, 
+so use it for parameters, not for members or containers.
+*/
+template < typename T, typename R = RC > class SPRef
+{
+private:
+    T*    pData;       // borrowed pointer
+    RCBlock<R>* reference; // control block of the SP we borrowed from, for Retain
+
+public:
+    SPRef(const SP<T, R>& sp) : pData(sp.pData), reference(sp.reference) //no reference count change
+    {
+    }
+
+    T& operator* () const
+    {
+        return *pData;
+    }
+
+    T* operator-> () const
+    {
+        return pData;
+    }
+
+    explicit operator bool () const
+    {
+        return pData != 0;
+    }
+
+    SP<T, R> Retain() const //a real reference, for when the callee keeps the object
+    {
+        SP<T, R> sp;
+        if (reference)
+        {
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+            sp.pData = pData;
+            sp.reference = reference;
+        }
+        return sp;
+    }
+};
+
+void ShowPerson(SPRef<Person> person) //only looks at the person, no count change
+{
+    person->Display();
+}
+
+void KeepPerson(SPRef<Person> person, std::vector< SP<Person> >& kept) //stores it, so retains it
+{
+    kept.push_back(person.Retain());
+}
+
+//Client code to borrow smart pointers
+void main()
+{
+    SP<Person> p = make_SP<Person>("Scott", 25);
+    std::vector< SP<Person> > kept;
+    for (int i = 0; i < 3; i++)
+    {
+        ShowPerson(p); //converted to SPRef implicitly, no AddRef and no Release
+    }
+    KeepPerson(p, kept); //one AddRef, for the copy in kept
+    kept[0]->Display();
+}
+
+//Biased reference counting
+/**
+Most of our objects are created, copied and dropped on one thread and only sometimes 
+reach another one, but AtomicRC makes every copy pay for an atomic operation. 
+BiasedRC counts in two places: the thread which created the object (the owner) 
+uses a plain int, the other threads use an atomic shared count. 
+The object is dead when the sum is zero, which nobody can see on its own, so: 
+
+- when the owner's count reaches zero it merges: it marks the shared count as merged 
+  and from then on every thread (the owner too) uses only the shared count. 
+- a reference counted by the owner may be dropped by another thread, then the shared count 
+  goes below zero. That thread puts the object on the owner's queue, and the owner merges it 
+  the next time it calls BiasedRC::MergeQueued(). 
+
+So an owner thread must call MergeQueued() from time to time (in its event loop for example), 
+or objects released by other threads are never deleted. 
+MergeQueued deletes an object without knowing its type, so whoever owns the memory 
+sets a dispose function: the control block of SP (BindBlock), IntrusiveSP (BindIntrusive) 
+or the handles of BasicSP (below).
+*/
+class BiasedRC
+{
+    private:
+    static const int Merged = 1; // the owner gave up its count, only shared counts now
+    static const int Queued = 2; // shared went below zero, the object waits on the owner's queue
+
+    struct MergeQueue
+    {
+        std::atomic<BiasedRC*> head; // pushed by other threads, emptied by the owner
+
+        MergeQueue() : head(0)
+        {
+        }
+    };
+
+    std::atomic<std::thread::id> owner; // thread which uses biased, nobody after the merge
+    int biased;                         // owner's count, no atomics
+    std::atomic<int> shared;            // other threads' count * 4 + flags, may go below zero
+    std::atomic<int> weak;              // Weak reference count, +1 as long as the object is alive
+    MergeQueue* queue;                  // owner's queue
+    BiasedRC* nextQueued;
+    std::atomic<void (*)(BiasedRC*)> dispose; // deletes the object when a merge finds it dead
+
+    static MergeQueue& LocalQueue()
+    {
+        // never deleted, other threads may still push to it
+        static thread_local MergeQueue* local = new MergeQueue();
+        return *local;
+    }
+
+    static int SharedCount(int value)
+    {
+        return (value - (value & 3)) / 4;
+    }
+
+    bool IsOwner() const
+    {
+        return owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    void Enqueue()
+    {
+        nextQueued = queue->head.load(std::memory_order_relaxed);
+        while (!queue->head.compare_exchange_weak(nextQueued, this, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void MergeOne(); // called by the owner for a queued object, defined after the class
+
+    public:
+    BiasedRC() : owner(std::this_thread::get_id()), biased(0), shared(0), weak(1), queue(&LocalQueue()), nextQueued(0), dispose(0)
+    {
+    }
+
+    void SetDispose(void (*pDispose)(BiasedRC*))
+    {
+        dispose.store(pDispose, std::memory_order_release);
+    }
+
+    void AddRef()
+    {
+        if (IsOwner())
+        {
+            biased++;
+        }
+        else
+        {
+            shared.fetch_add(4, std::memory_order_relaxed);
+        }
+    }
+
+    int Release()
+    {
+        // returns 0 when the object has to be deleted now, something else otherwise
+        if (IsOwner())
+        {
+            if (--biased > 0)
+            {
+                return biased;
+            }
+            // merge, the object is dead if nobody else holds a reference and it is not queued
+            owner.store(std::thread::id(), std::memory_order_relaxed);
+            int value = shared.fetch_add(Merged, std::memory_order_acq_rel) + Merged;
+            return value == Merged ? 0 : 1;
+        }
+        int value = shared.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            int next = value - 4;
+            bool enqueue = SharedCount(next) < 0 && (next & (Merged | Queued)) == 0;
+            if (enqueue)
+            {
+                next |= Queued;
+            }
+            if (shared.compare_exchange_weak(value, next, std::memory_order_release, std::memory_order_relaxed))
+            {
+                if (enqueue)
+                {
+                    Enqueue(); // the owner counted this reference, it has to merge
+                    return 1;
+                }
+                if (next == Merged)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    return 0;
+                }
+                return 1;
+            }
+        }
+    }
+
+    bool AddRefIfAlive()
+    {
+        if (IsOwner())
+        {
+            biased++; // not merged yet, so the owner still holds a reference
+            return true;
+        }
+        int value = shared.load(std::memory_order_relaxed);
+        while (!((value & Merged) && SharedCount(value) == 0))
+        {
+            if (shared.compare_exchange_weak(value, value + 4, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void AddWeak()
+    {
+        weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int ReleaseWeak()
+    {
+        int result = weak.fetch_sub(1, std::memory_order_release) - 1;
+        if (result == 0)
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return result;
+    }
+
+    int Count() const
+    {
+        // exact on the owner, elsewhere the owner's part is unknown and counted as two,
+        // so another thread never takes a shared object for a unique one
+        int value = shared.load(std::memory_order_acquire);
+        if (value & Merged)
+        {
+            return SharedCount(value);
+        }
+        if (IsOwner())
+        {
+            return biased + SharedCount(value);
+        }
+        int count = SharedCount(value) + 2;
+        return count > 2 ? count : 2;
+    }
+
+    static void MergeQueued() //call it on every owner thread from time to time
+    {
+        BiasedRC* item = LocalQueue().head.exchange(0, std::memory_order_acquire);
+        while (item)
+        {
+            BiasedRC* next = item->nextQueued; // item may be deleted by MergeOne
+            item->MergeOne();
+            item = next;
+        }
+    }
+};
+
+inline void BiasedRC::MergeOne()
+{
+    int value;
+    if (IsOwner())
+    {
+        // move our count into shared, mark it merged and take it off the queue at once
+        int add = biased * 4 + Merged - Queued;
+        biased = 0;
+        owner.store(std::thread::id(), std::memory_order_relaxed);
+        value = shared.fetch_add(add, std::memory_order_acq_rel) + add;
+    }
+    else
+    {
+        // already merged by Release, only take it off the queue
+        value = shared.fetch_sub(Queued, std::memory_order_acq_rel) - Queued;
+    }
+    if (value == Merged)
+    {
+        // nobody holds a reference any more, delete it the way its owner does
+        void (*pDispose)(BiasedRC*) = dispose.load(std::memory_order_acquire);
+        if (pDispose) // unset only for a count which is not in an SP block or an IntrusiveSP object
+        {
+            pDispose(this);
+        }
+    }
+}
+
+template < typename B > void DisposeBlock(BiasedRC* rc)
+{
+    B* block = static_cast<B*>(rc);
+    block->Dispose();
+    if (block->ReleaseWeak() == 0)
+    {
+        block->Destroy();
+    }
+}
+
+template < typename R > void BindBlock(RCBlock<R>*, BiasedRC* rc) //RCBlock<BiasedRC>, or a wrapper like CacheAlignedRC<BiasedRC>
+{
+    rc->SetDispose(&DisposeBlock< RCBlock<R> >);
+}
+
+template < typename T > void DisposeIntrusive(BiasedRC* rc)
+{
+    delete static_cast<T*>(rc);
+}
+
+template < typename T > void BindIntrusive(T*, BiasedRC* rc) //T derives from RefCounted<BiasedRC>
+{
+    rc->SetDispose(&DisposeIntrusive<T>);
+}
+
+//Client code to use biased reference counting
+void main()
+{
+    SP<Person, BiasedRC> p = make_SP<Person, BiasedRC>("Scott", 25); //this thread owns the count
+    for (int i = 0; i < 1000000; i++)
+    {
+        SP<Person, BiasedRC> q = p; //owner thread, plain ++ and --
+    }
+    std::thread worker([p]() //the copy into the lambda is counted by the owner
+    {
+        SP<Person, BiasedRC> r = p; //worker thread, atomic shared count
+        r->Display();
+        // Destructors of r and of the lambda's copy will be called here,
+        // the second one takes shared below zero and queues Scott for the owner
+    });
+    worker.join();
+    p = SP<Person, BiasedRC>(); //drop the owner's last reference, Scott is still queued
+    BiasedRC::MergeQueued();    //the owner merges the counts, and Scott is deleted
+}
+
+//Sharing one smart pointer slot between threads
+/**
+Copying one SP object while another thread assigns to it is a data race, even with AtomicRC: 
+the reader may copy pData and reference just as the writer releases the old block. 
+AtomicSP is a slot which many threads load and occasionally store without any lock. 
+The published SP sits in an immutable box, and the slot is a single 64 bit word: 
+the pointer to the box in the low 48 bits, the number of threads inside load() in the high 16. 
+A reader adds itself to that number with one fetch_add, so the box cannot be deleted 
+under it, copies the SP out of the box and takes itself off the number again. 
+A writer swaps in a new box and, with one fetch_add on the old box's own count, 
+turns the readers still counted in the old word into references to it and drops the slot's reference. 
+Those readers drop their references when they notice the swap, possibly before the writer's add, 
+so the count may go below zero meanwhile, and whoever brings it to exactly zero deletes the box 
+(split reference counting). The count must be AtomicRC (or BiasedRC, or either of them in CacheAlignedRC): 
+copies of the published SP are made on every reader thread, ThreadSafeRC<R> says which counts may be used. 
+It assumes pointers fit in 48 bits, which holds for user space on x86-64 and AArch64, 
+and at most 65535 threads inside load() at the same time.
+*/
+template < typename R > struct ThreadSafeRC //may references counted by R be copied and dropped on any thread
+{
+    static const bool Value = false;
+};
+
+template < > struct ThreadSafeRC<AtomicRC>
+{
+    static const bool Value = true;
+};
+
+template < > struct ThreadSafeRC<BiasedRC>
+{
+    static const bool Value = true;
+};
+
+template < typename T, typename R = AtomicRC > class AtomicSP
+{
+    static_assert(ThreadSafeRC<R>::Value, "AtomicSP is read from many threads, its count must be AtomicRC or BiasedRC");
+
+private:
+    struct Box
+    {
+        SP<T, R> value;               // never changed once the box is published
+        std::atomic<int64_t> count;   // readers folded in by the writer minus readers which have left, may go below zero
+
+        Box(SP<T, R>&& sp) : value(std::move(sp)), count(0)
+        {
+        }
+    };
+
+    static const uint64_t Reader = uint64_t(1) << 48;
+    static const uint64_t PointerMask = Reader - 1;
+    static_assert(sizeof(void*) == 8, "AtomicSP needs 64 bit pointers");
+
+    mutable std::atomic<uint64_t> slot; // box pointer + readers inside load()
+
+    static Box* BoxOf(uint64_t value)
+    {
+        return reinterpret_cast<Box*>(value & PointerMask);
+    }
+
+    static void ReleaseBox(Box* box) //a reader which was counted in the slot when the box was swapped out
+    {
+        if (box->count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete box;
+        }
+    }
+
+    static uint64_t NewBox(SP<T, R>&& sp) //0 for an empty SP
+    {
+        if (!sp.reference)
+        {
+            return 0;
+        }
+        return reinterpret_cast<uintptr_t>(new Box(std::move(sp)));
+    }
+
+    static SP<T, R> Retire(uint64_t value) //value was just swapped out of the slot
+    {
+        Box* box = BoxOf(value);
+        if (!box)
+        {
+            return SP<T, R>();
+        }
+        // copy first, once the readers are folded in the last of them may delete the box
+        SP<T, R> old = box->value;
+        // the readers still counted in value become references and the slot's reference goes, in one step:
+        // readers which left already have taken the count below zero, whoever brings it to zero deletes
+        int64_t readers = int64_t(value >> 48);
+        if (box->count.fetch_add(readers, std::memory_order_acq_rel) + readers == 0)
+        {
+            delete box;
+        }
+        return old;
+    }
+
+    void Leave(Box* box, uint64_t value) const //take our reader count off the slot again
+    {
+        while (BoxOf(value) == box)
+        {
+            if (slot.compare_exchange_weak(value, value - Reader, std::memory_order_release, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+        // the box was swapped out and our count became a reference to it
+        if (box)
+        {
+            ReleaseBox(box);
+        }
+    }
+
+public:
+    AtomicSP() : slot(0)
+    {
+    }
+
+    AtomicSP(SP<T, R> sp) : slot(NewBox(std::move(sp)))
+    {
+    }
+
+    AtomicSP(const AtomicSP<T, R>&) = delete;
+    AtomicSP<T, R>& operator = (const AtomicSP<T, R>&) = delete;
+
+    ~AtomicSP()
+    {
+        Retire(slot.load(std::memory_order_acquire));
+    }
+
+    SP<T, R> load() const
+    {
+        uint64_t value = slot.fetch_add(Reader, std::memory_order_acquire) + Reader;
+        Box* box = BoxOf(value);
+        SP<T, R> sp;
+        if (box)
+        {
+            sp = box->value; // the box stays alive while we are counted
+        }
+        Leave(box, value);
+        return sp;
+    }
+
+    void store(SP<T, R> desired)
+    {
+        exchange(std::move(desired));
+    }
+
+    SP<T, R> exchange(SP<T, R> desired)
+    {
+        return Retire(slot.exchange(NewBox(std::move(desired)), std::memory_order_acq_rel));
+    }
+
+    bool compare_exchange(SP<T, R>& expected, SP<T, R> desired) //like compare_exchange_strong
+    {
+        uint64_t fresh = NewBox(std::move(desired));
+        for (;;)
+        {
+            // enter like load(), so the current box cannot go away while we look at it
+            uint64_t value = slot.fetch_add(Reader, std::memory_order_acquire) + Reader;
+            Box* box = BoxOf(value);
+            bool same = box ? box->value.pData == expected.pData && box->value.reference == expected.reference
+                            : !expected.reference;
+            if (!same)
+            {
+                expected = box ? box->value : SP<T, R>();
+                Leave(box, value);
+                delete BoxOf(fresh); // never published
+                return false;
+            }
+            while (BoxOf(value) == box)
+            {
+                if (slot.compare_exchange_weak(value, fresh, std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                    Retire(value - Reader); // every reader but us becomes a reference
+                    return true;
+                }
+            }
+            // another writer was faster, our count became a reference to the old box
+            if (box)
+            {
+                ReleaseBox(box);
+            }
+        }
+    }
+};
+
+//Client code to publish a person to many reader threads
+void main()
+{
+    AtomicSP<Person> current(make_SP<Person, AtomicRC>("Scott", 25));
+    std::atomic<bool> done(false);
+    std::thread readers[4];
+    for (int i = 0; i < 4; i++)
+    {
+        readers[i] = std::thread([&current, &done]()
+        {
+            while (!done.load())
+            {
+                SP<Person, AtomicRC> p = current.load(); //no lock, p stays valid after a store
+            }
+        });
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        current.store(make_SP<Person, AtomicRC>("Tom", i)); //the old person is deleted by its last reader
+    }
+    SP<Person, AtomicRC> expected = current.load();
+    current.compare_exchange(expected, make_SP<Person, AtomicRC>("Bob", 40)); //only if nobody stored meanwhile
+    done.store(true);
+    for (int i = 0; i < 4; i++)
+    {
+        readers[i].join();
+    }
+    current.load()->Display();
+}
+
+//Epoch based reclamation
+/**
+A reader which walks a lock-free list would have to AddRef and Release every node on its way 
+to make sure the node is not deleted under it, and with AtomicRC that is two atomic operations 
+on a shared cache line per step. With an EpochDomain the reader only marks the whole walk 
+as a read-side critical section (an EpochDomain::Guard), and the nodes are plain pointers. 
+A node taken out of the structure is given to Retire instead of delete, 
+and it is deleted once every thread which might still see it has left its critical section: 
+
+- the domain has a global epoch, and every thread records the epoch it saw when it entered. 
+- the epoch only moves on when every thread inside a critical section has seen the current one. 
+- a node retired in epoch e can be deleted when the global epoch is e + 2: 
+  by then every reader which could have seen the node has left. 
+
+Retire and Collect free what is safe, no thread ever waits for another one. 
+SP is needed only where ownership really changes hands (an SP to the list itself, say), 
+not on every step inside it. A domain must outlive every other thread which used it, 
+EpochDomain::Global() lives as long as the process.
+*/
+class EpochDomain
+{
+    private:
+    struct Retired
+    {
+        void* pObject;
+        void (*destroy)(void*);
+        uint64_t epoch;
+    };
+
+    struct ThreadRecord
+    {
+        std::atomic<uint64_t> state;  // epoch * 2 + 1 inside a critical section, 0 outside
+        std::atomic<bool> inUse;      // taken by a thread
+        ThreadRecord* next;           // list of every record, never shrinks
+        int depth;                    // nested guards of the owning thread
+        std::vector<Retired> retired; // retired by the owning thread, not freed yet
+
+        ThreadRecord() : state(0), inUse(true), next(0), depth(0)
+        {
+        }
+    };
+
+    struct ThreadRecords //the records of one thread, one per domain, given back at thread exit
+    {
+        std::vector< std::pair<EpochDomain*, ThreadRecord*> > records;
+
+        ~ThreadRecords()
+        {
+            for (size_t i = 0; i < records.size(); i++)
+            {
+                records[i].first->ReleaseRecord(records[i].second);
+            }
+        }
+    };
+
+    static const size_t CollectEvery = 64; // retired objects per thread before it tries to collect
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<ThreadRecord*> records;
+    std::mutex orphanLock;
+    std::vector<Retired> orphans; // retired by threads which have exited
+
+    static ThreadRecords& Local()
+    {
+        static thread_local ThreadRecords local;
+        return local;
+    }
+
+    ThreadRecord* Record()
+    {
+        ThreadRecords& local = Local();
+        for (size_t i = 0; i < local.records.size(); i++)
+        {
+            if (local.records[i].first == this)
+            {
+                return local.records[i].second;
+            }
+        }
+        ThreadRecord* record = AcquireRecord();
+        local.records.push_back(std::make_pair(this, record));
+        return record;
+    }
+
+    ThreadRecord* AcquireRecord()
+    {
+        // reuse the record of a thread which has exited
+        for (ThreadRecord* record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            bool free = false;
+            if (!record->inUse.load(std::memory_order_relaxed) && record->inUse.compare_exchange_strong(free, true, std::memory_order_acquire))
+            {
+                return record;
+            }
+        }
+        ThreadRecord* record = new ThreadRecord();
+        record->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+        return record;
+    }
+
+    void ReleaseRecord(ThreadRecord* record)
+    {
+        {
+            std::lock_guard<std::mutex> guard(orphanLock);
+            orphans.insert(orphans.end(), record->retired.begin(), record->retired.end());
+        }
+        record->retired.clear();
+        record->inUse.store(false, std::memory_order_release);
+    }
+
+    bool TryAdvance(uint64_t current)
+    {
+        // pairs with the fence of Guard: our unlink of a retired object happens before
+        // the scan, so a reader whose state we miss here will not find that object
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (ThreadRecord* record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            uint64_t state = record->state.load(std::memory_order_acquire);
+            if (state != 0 && state != current * 2 + 1)
+            {
+                return false; // somebody is still inside an older epoch
+            }
+        }
+        return epoch.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel);
+    }
+
+    static size_t Free(std::vector<Retired>& retired, uint64_t safe) //frees what was retired before safe
+    {
+        size_t kept = 0;
+        size_t freed = 0;
+        for (size_t i = 0; i < retired.size(); i++)
+        {
+            if (retired[i].epoch < safe)
+            {
+                retired[i].destroy(retired[i].pObject);
+                freed++;
+            }
+            else
+            {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize(kept);
+        return freed;
+    }
+
+    template < typename T > static void Delete(void* pObject)
+    {
+        delete static_cast<T*>(pObject);
+    }
+
+    public:
+    class Guard //read-side critical section, pointers read inside stay valid until it ends
+    {
+        private:
+        EpochDomain& domain;
+        ThreadRecord* record;
+
+        public:
+        Guard(EpochDomain& d) : domain(d), record(d.Record())
+        {
+            if (record->depth++ == 0)
+            {
+                record->state.store(domain.epoch.load(std::memory_order_relaxed) * 2 + 1, std::memory_order_relaxed);
+                // our state must be visible before we read any pointer of the structure
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        ~Guard()
+        {
+            if (--record->depth == 0)
+            {
+                record->state.store(0, std::memory_order_release);
+            }
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator = (const Guard&) = delete;
+    };
+
+    EpochDomain() : epoch(1), records(0)
+    {
+    }
+
+    ~EpochDomain()
+    {
+        std::vector< std::pair<EpochDomain*, ThreadRecord*> >& local = Local().records;
+        for (size_t i = 0; i < local.size(); i++)
+        {
+            if (local[i].first == this) //the destroying thread gives its record back now
+            {
+                local.erase(local.begin() + i);
+                break;
+            }
+        }
+        ThreadRecord* record = records.load(std::memory_order_acquire);
+        while (record)
+        {
+            ThreadRecord* next = record->next;
+            Free(record->retired, UINT64_MAX);
+            delete record;
+            record = next;
+        }
+        Free(orphans, UINT64_MAX);
+    }
+
+    static EpochDomain& Global()
+    {
+        static EpochDomain* domain = new EpochDomain(); // never destroyed, threads may outlive main
+        return *domain;
+    }
+
+    void Retire(void* pObject, void (*destroy)(void*)) //called instead of delete
+    {
+        ThreadRecord* record = Record();
+        Retired retired = { pObject, destroy, epoch.load(std::memory_order_acquire) };
+        record->retired.push_back(retired);
+        if (record->retired.size() % CollectEvery == 0)
+        {
+            Collect();
+        }
+    }
+
+    template < typename T > void Retire(T* pObject)
+    {
+        Retire(pObject, &EpochDomain::Delete<T>);
+    }
+
+    size_t Collect() //move the epoch on if possible and free what is safe, returns how many objects
+    {
+        uint64_t current = epoch.load(std::memory_order_acquire);
+        if (TryAdvance(current))
+        {
+            current++;
+        }
+        if (current < 2)
+        {
+            return 0;
+        }
+        size_t freed = Free(Record()->retired, current - 1);
+        std::unique_lock<std::mutex> guard(orphanLock, std::try_to_lock);
+        if (guard.owns_lock())
+        {
+            freed += Free(orphans, current - 1);
+        }
+        return freed;
+    }
+};
+
+//a lock-free list of persons, readers walk it with no reference counting at all
+struct PersonNode
+{
+    Person person;
+    std::atomic<PersonNode*> next;
+
+    PersonNode(const char* pName, int age) : person(pName, age), next(0)
+    {
+    }
+};
+
+//Client code to use epoch based reclamation
+void main()
+{
+    EpochDomain& domain = EpochDomain::Global();
+    std::atomic<PersonNode*> head(0);
+    std::atomic<bool> done(false);
+
+    std::thread reader([&]()
+    {
+        while (!done.load())
+        {
+            EpochDomain::Guard guard(domain); //every node we reach stays valid until here
+            int count = 0;
+            for (PersonNode* node = head.load(std::memory_order_acquire); node; node = node->next.load(std::memory_order_acquire))
+            {
+                count++;
+            }
+        }
+    });
+
+    for (int i = 0; i < 10000; i++)
+    {
+        PersonNode* node = new PersonNode("Scott", i); //push at the front
+        node->next.store(head.load());
+        head.store(node, std::memory_order_release);
+
+        if (i % 2 == 1) //and take one off again, only this thread writes the list
+        {
+            PersonNode* first = head.load();
+            head.store(first->next.load(), std::memory_order_release);
+            domain.Retire(first); //deleted once the reader cannot see it any more
+        }
+    }
+    done.store(true);
+    reader.join();
+
+    PersonNode* node = head.exchange(0);
+    while (node)
+    {
+        PersonNode* next = node->next.load();
+        domain.Retire(node);
+        node = next;
+    }
+    domain.Collect();
+}
+
+//Smart pointers to arrays
+/**
+SP<Person> deletes its data with delete, so it cannot own a batch made with new Person[n], 
+and giving every element its own SP costs one control block per element. 
+SP<Person[]> is a partial specialization of SP for arrays: it deletes the batch with delete[] 
+(DefaultDeleter<T[]>), gives access to the elements with operator[], 
+and has no operator-> or operator* since there is no single object to point at. 
+
+Element(i) hands out an SP<Person> to one element which shares the control block of the batch: 
+no allocation and one reference more on the same count, 
+so the whole batch lives as long as any of its elements is still used. 
+A million persons cost one control block instead of a million of them.
+*/
+template < typename T > struct DefaultDeleter<T[]> //arrays are deleted with delete[]
+{
+    void operator() (T* pValue) const
+    {
+        delete[] pValue;
+    }
+};
+
+template < typename T, typename R > class SP<T[], R>
+{
+private:
+    T*    pData;       // first element of the batch
+    RCBlock<R>* reference; // one control block for the whole batch
+
+    template < typename U, typename Q > friend class SP;
+
+    void ReleaseReference()
+    {
+        if (reference)
+        {
+            SP_STATS_RELEASE(T);
+        }
+        if (reference && reference->Release() == 0)
+        {
+            reference->Dispose();
+            if (reference->ReleaseWeak() == 0)
+            {
+                reference->Destroy();
+            }
+        }
+    }
+
+public:
+    SP() : pData(0), reference(0)
+    {
+    }
+
+    SP(T* pValue) : pData(pValue), reference(0) //takes a batch made with new T[n]
+    {
+        if (pData)
+        {
+            try
+            {
+                reference = new RCPointer<T, R, DefaultDeleter<T[]> >(pData);
+            }
+            catch (...)
+            {
+                delete[] pValue;
+                throw;
+            }
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    template < typename D > SP(T* pValue, D deleter) : pData(pValue), reference(0) //deleter gets the first element
+    {
+        if (pData)
+        {
+            try
+            {
+                reference = new RCPointer<T, R, D>(pData, deleter);
+            }
+            catch (...)
+            {
+                deleter(pValue);
+                throw;
+            }
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    SP(const SP<T[], R>& sp) : pData(sp.pData), reference(sp.reference)
+    {
+        if (reference)
+        {
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    SP(SP<T[], R>&& sp) noexcept : pData(sp.pData), reference(sp.reference)
+    {
+        sp.pData = 0;
+        sp.reference = 0;
+    }
+
+    ~SP()
+    {
+        ReleaseReference();
+    }
+
+    T& operator[] (size_t index) const
+    {
+        return pData[index];
+    }
+
+    SP<T, R> Element(size_t index) const //shares the block of the batch, no allocation
+    {
+        if (!reference)
+        {
+            return SP<T, R>();
+        }
+        return SP<T, R>(pData + index, reference);
+    }
+
+    explicit operator bool () const
+    {
+        return pData != 0;
+    }
+
+    int use_count() const
+    {
+        return reference ? reference->Count() : 0;
+    }
+
+    bool unique() const
+    {
+        return use_count() == 1;
+    }
+
+    SP<T[], R>& operator = (const SP<T[], R>& sp)
+    {
+        SP<T[], R>(sp).swap(*this);
+        return *this;
+    }
+
+    SP<T[], R>& operator = (SP<T[], R>&& sp) noexcept
+    {
+        SP<T[], R>(std::move(sp)).swap(*this);
+        return *this;
+    }
+
+    void swap(SP<T[], R>& sp) noexcept
+    {
+        std::swap(pData, sp.pData);
+        std::swap(reference, sp.reference);
+    }
+};
+
+//Client code to use a smart pointer to an array
+void main()
+{
+    Person* batch = new Person[1000];
+    SP<Person[]> people(batch); //one control block for all of them
+    for (int i = 0; i < 1000; i++)
+    {
+        people[i] = Person("Scott", 20 + i % 50);
+    }
+
+    SP<Person> third = people.Element(3); //shares the count of the batch
+    people = SP<Person[]>(); //the batch is still alive, third refers to it
+    third->Display();
+    // the batch is deleted with delete[] here, together with third
+}
+
+//Pointing into an object
+/**
+To hand out the name or the age of a person on their own, 
+SP<int>(new int(p->Age())) would allocate and copy. 
+The aliasing constructor SP<int> age(p, &p->Age()) instead points at the member 
+and shares the control block of p: no allocation, no copy, one reference more on p's count. 
+The person is deleted only when p and every pointer into it are gone, 
+so the member can never be used after the person is deleted. 
+It works with the elements of an array as well: SP<Person>(people, &people[3]). 
+The pointer must stay valid as long as the owner does, 
+the name of a person changes when the person is assigned (see Person::Name).
+*/
+
+//Client code to use the aliasing constructor
+void main()
+{
+    SP<const char> name;
+    SP<int> age;
+    {
+        SP<Person> p = make_SP<Person>("Scott", 25);
+        name = SP<const char>(p, p->Name()); //shares p's count, nothing allocated
+        age = SP<int>(p, &p->Age());
+        // p goes away here, the person does not
+    }
+    *age += 20;
+    printf("%s is %d\n", &*name, *age);
+    // the person is deleted with the last of name and age
+}
+
+//Copy on write
+/**
+Most of our persons are copies of one template record which are only read, 
+and a few of them are changed later (age += 20). Copying each of them up front costs 
+memory and time for records which never change. COW shares one object through an SP 
+for as long as all the copies only read it: operator-> and operator* give const access. 
+Write() gives non-const access, and when the object is shared at that moment (use_count() > 1) 
+it first makes a private copy with make_SP, so the other copies do not see the change. 
+Once a COW owns its object alone, further writes do not copy again. 
+
+use_count() and unique() come from Count() of the counting class. 
+With AtomicRC a count of one also means no other thread can still be reading, 
+BiasedRC reports a shared object as shared whatever thread asks. 
+A WeakSP to the object can make a new reference out of nothing, so do not mix the two. 
+A COW is never empty, it needs an object to start with.
+*/
+template < typename T, typename R = RC > class COW
+{
+    private:
+    SP<T, R> pData; // shared with the other copies until we write
+
+    public:
+    explicit COW(const T& value) : pData(make_SP<T, R>(value)) //the only copy we make up front
+    {
+    }
+
+    explicit COW(const SP<T, R>& sp) : pData(sp)
+    {
+    }
+
+    const T& operator* () const
+    {
+        return *pData;
+    }
+
+    const T* operator-> () const
+    {
+        return pData.operator->();
+    }
+
+    T& Write() //non-const access, copies the object first if somebody else shares it
+    {
+        if (!pData.unique())
+        {
+            pData = make_SP<T, R>(*pData);
+        }
+        return *pData;
+    }
+
+    int use_count() const
+    {
+        return pData.use_count();
+    }
+};
+
+//Client code to use copy on write persons
+void main()
+{
+    COW<Person> record(Person("Scott", 25)); //the template record
+    std::vector< COW<Person> > people(1000, record); //no person is copied, only the count grows
+    printf("%d share the record\n", record.use_count());
+
+    people[7].Write().Age() += 20; //only this one is copied now
+    people[7].Write().Age() += 1;  //and not again
+    printf("%s %d, %s %d\n", people[0]->Name(), people[0].use_count(), people[7]->Name(), people[7].use_count());
+}
+
+//Measuring smart pointers
+/**
+To know whether a change to SP or to a counting class helps, we measure it. 
+Bench runs a loop of operations on one thread or on several at once and prints for it: 
+
+- ns/op, the wall time divided by the operations of all threads together. 
+- allocs/op, counted by the replacement of operator new below when built with SP_BENCH, 
+  n/a otherwise. Every form of new is replaced and counts on its own thread, 
+  the counts of the workers are added up after they have been joined. 
+- misses/op, the cache misses counted by the CPU (perf_event_open), 
+  "n/a" where there is no such counter (not Linux, or perf events not allowed). 
+
+Each counting class is measured for construction and destruction 
+(SP(new T), make_SP and allocate_SP with the PoolAllocator), copy, move and copy assignment. 
+RC is only measured on one thread, it is not thread-safe. 
+With several threads all of them copy and assign the same two pointers, 
+which is the worst case for a shared count. 
+
+BenchGate turns the table into a regression gate. With SP_BENCH_BASELINE=file 
+the first run writes its ns/op to the file, and later runs fail every case 
+which is more than SP_BENCH_TOLERANCE percent (25 by default) slower than the file says. 
+The client exits with status 1 if any case failed.
+There is no atomic in the operations of RC, so the compiler could merge an AddRef with the next Release 
+and measure nothing: a signal fence after every operation stops it, it costs no instruction.
+*/
+#ifdef SP_BENCH
+thread_local long long benchAllocations = 0; // calls of operator new on this thread, no shared line to fight over
+
+void* BenchAllocate(size_t size, size_t align)
+{
+    benchAllocations++;
+    size = size ? size : 1;
+    void* p = align <= alignof(std::max_align_t) ? malloc(size) : aligned_alloc(align, (size + align - 1) / align * align);
+    return p;
+}
+
+// the compiler sees new and free in one function and mistakes it for a mismatch
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new (size_t size)
+{
+    void* p = BenchAllocate(size, 0);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[] (size_t size)
+{
+    return operator new (size);
+}
+
+void* operator new (size_t size, std::align_val_t align)
+{
+    void* p = BenchAllocate(size, (size_t)align);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[] (size_t size, std::align_val_t align)
+{
+    return operator new (size, align);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+    return BenchAllocate(size, 0);
+}
+
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+    return BenchAllocate(size, 0);
+}
+
+void* operator new (size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    return BenchAllocate(size, (size_t)align);
+}
+
+void* operator new[] (size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    return BenchAllocate(size, (size_t)align);
+}
+
+void operator delete (void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+inline long long BenchAllocations() //operator new calls of this thread so far
+{
+    return benchAllocations;
+}
+#else
+inline long long BenchAllocations() //not counted, -1
+{
+    return -1;
+}
+#endif
+
+class BenchCounter //cache misses of this thread and of the threads it starts afterwards
+{
+    private:
+    int fd;
+
+    public:
+    BenchCounter() : fd(-1)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~BenchCounter()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    long long Read() //-1 if there is no counter
+    {
+        uint64_t value;
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        {
+            return -1;
+        }
+        return (long long)value;
+    }
+};
+
+class BenchGate //compares every case with the ns/op of an earlier run
+{
+    private:
+    struct Result
+    {
+        char name[64];
+        int threads;
+        double ns;
+    };
+
+    std::vector<Result> baseline; // read from the file
+    std::vector<Result> results;  // of this run
+    bool failed;
+
+    BenchGate() : failed(false)
+    {
+        const char* pPath = getenv("SP_BENCH_BASELINE");
+        FILE* file = pPath ? fopen(pPath, "r") : 0;
+        if (file)
+        {
+            Result result;
+            while (fscanf(file, "%d %lf %63[^\n]", &result.threads, &result.ns, result.name) == 3)
+            {
+                baseline.push_back(result);
+            }
+            fclose(file);
+        }
+    }
+
+    public:
+    static BenchGate& Get()
+    {
+        static BenchGate gate;
+        return gate;
+    }
+
+    void Check(const char* pName, int threads, double ns)
+    {
+        Result result;
+        snprintf(result.name, sizeof(result.name), "%s", pName);
+        result.threads = threads;
+        result.ns = ns;
+        results.push_back(result);
+
+        const char* pTolerance = getenv("SP_BENCH_TOLERANCE");
+        double limit = 1 + (pTolerance ? atof(pTolerance) : 25) / 100;
+        for (size_t i = 0; i < baseline.size(); i++)
+        {
+            if (baseline[i].threads == threads && strcmp(baseline[i].name, result.name) == 0 && ns > baseline[i].ns * limit)
+            {
+                printf("FAIL %s: %.2f ns/op, baseline %.2f\n", pName, ns, baseline[i].ns);
+                failed = true;
+            }
+        }
+    }
+
+    int Finish() //1 if a case got slower, the first run without a baseline file writes it
+    {
+        const char* pPath = getenv("SP_BENCH_BASELINE");
+        if (pPath && baseline.empty())
+        {
+            FILE* file = fopen(pPath, "w");
+            for (size_t i = 0; file && i < results.size(); i++)
+            {
+                fprintf(file, "%d %.2f %s\n", results[i].threads, results[i].ns, results[i].name);
+            }
+            if (file)
+            {
+                fclose(file);
+            }
+        }
+        return failed ? 1 : 0;
+    }
+};
+
+template < typename F > void Bench(const char* pName, int threads, long ops, F body) //body(ops) does ops operations
+{
+    BenchCounter misses;
+    long long allocations = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (threads == 1)
+    {
+        long long before = BenchAllocations();
+        body(ops);
+        allocations = BenchAllocations() - before;
+    }
+    else
+    {
+        std::vector<long long> counts(threads); // each worker's own count, summed after the join
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++)
+        {
+            long long& count = counts[i];
+            workers.emplace_back([&body, &count, ops]()
+            {
+                long long before = BenchAllocations();
+                body(ops);
+                count = BenchAllocations() - before;
+            });
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+            allocations += counts[i];
+        }
+    }
+    double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    long long missed = misses.Read();
+    double total = (double)ops * threads;
+    printf("%-34s %2d threads %8.2f ns/op ", pName, threads, ns / total);
+    if (BenchAllocations() < 0)
+    {
+        printf("allocs n/a ");
+    }
+    else
+    {
+        printf("%5.2f allocs/op ", allocations / total);
+    }
+    if (missed < 0)
+    {
+        printf("misses n/a\n");
+    }
+    else
+    {
+        printf("%6.3f misses/op\n", missed / total);
+    }
+    BenchGate::Get().Check(pName, threads, ns / total);
+}
+
+inline void BenchFence() //keeps the compiler from merging the operations of the loop
+{
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+template < typename R > void BenchPolicy(const char* pPolicy, int threads, long ops)
+{
+    char name[64];
+    SP<int, R> x = make_SP<int, R>(1); // shared by all threads
+    SP<int, R> y = make_SP<int, R>(2);
+
+    snprintf(name, sizeof(name), "%s SP(new T)", pPolicy);
+    Bench(name, threads, ops, [](long n)
+    {
+        for (long i = 0; i < n; i++)
+        {
+            SP<int, R> p(new int(1));
+            BenchFence();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s make_SP", pPolicy);
+    Bench(name, threads, ops, [](long n)
+    {
+        for (long i = 0; i < n; i++)
+        {
+            SP<int, R> p = make_SP<int, R>(1);
+            BenchFence();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s allocate_SP pool", pPolicy);
+    Bench(name, threads, ops, [](long n)
+    {
+        for (long i = 0; i < n; i++)
+        {
+            SP<int, R> p = allocate_SP<int, R>(PoolAllocator<int>(), 1);
+            BenchFence();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s copy", pPolicy);
+    Bench(name, threads, ops, [&x](long n)
+    {
+        for (long i = 0; i < n; i++)
+        {
+            SP<int, R> p(x);
+            BenchFence();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s move", pPolicy);
+    Bench(name, threads, ops, [](long n)
+    {
+        SP<int, R> a = make_SP<int, R>(1);
+        for (long i = 0; i < n; i += 2)
+        {
+            SP<int, R> b(std::move(a));
+            BenchFence();
+            a = std::move(b);
+            BenchFence();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s copy assignment", pPolicy);
+    Bench(name, threads, ops, [&x, &y](long n)
+    {
+        SP<int, R> a;
+        for (long i = 0; i < n; i += 2)
+        {
+            a = x;
+            BenchFence();
+            a = y;
+            BenchFence();
+        }
+    });
+}
+
+//Client code to measure smart pointers
+void main()
+{
+    const long ops = 1000000;
+    int threads = (int)std::thread::hardware_concurrency();
+    threads = threads < 2 ? 2 : threads > 8 ? 8 : threads;
+
+    BenchPolicy<RC>("RC", 1, ops);
+    BenchPolicy<AtomicRC>("AtomicRC", 1, ops);
+    BenchPolicy<AtomicRC>("AtomicRC", threads, ops);
+    BenchPolicy<BiasedRC>("BiasedRC", 1, ops);
+    BenchPolicy<BiasedRC>("BiasedRC", threads, ops);
+    BiasedRC::MergeQueued();
+
+    if (BenchGate::Get().Finish() != 0)
+    {
+        exit(1);
+    }
+}
+
+//Client code to read the instrumentation counters
+void main()
+{
+#ifdef SP_INSTRUMENT
+    {
+        SP<Person> p = make_SP<Person>("Scott", 25);
+        std::vector< SP<Person> > copies(100, p);
+        Person* batch = new Person[10];
+        SP<Person[]> people(batch);
+        SP<Person> fifth = people.Element(5);
+    }
+    std::vector<SPStatsSnapshot> all = SPStats::SnapshotAll();
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        const SPStatsSnapshot& stats = all[i];
+        printf("%s: %lld blocks, %lld AddRef, %lld Release, %lld live, %lld peak\n",
+            stats.pType, stats.blocks, stats.addRefs, stats.releases, stats.live, stats.peak);
+        for (int bucket = 0; bucket < SPStatsBuckets; bucket++)
+        {
+            if (stats.latency[bucket])
+            {
+                printf("    destroyed in < %lld ns: %lld\n", 1LL << bucket, stats.latency[bucket]);
+            }
+        }
+    }
+#else
+    printf("built without SP_INSTRUMENT, nothing was counted\n");
+#endif
+}
+
+//Smart pointers put together from policies
+/**
+SP pays for being able to take anything: a virtual Dispose so that any deleter, 
+allocator or in-place object fits behind the same RCBlock<R>*, and pData next to the block. 
+When the configuration is known at compile time BasicSP<T, Counting, Storage, Deleter> 
+builds exactly the pointer that is asked for and nothing else, 
+there is no virtual function and no member which the configuration does not use: 
+
+- Counting is NoRC, RC, AtomicRC or BiasedRC. NoRC counts nothing, a BasicSP with it is a single owner: 
+  it can be moved but not copied, its handle has no copy constructor. 
+- Storage says where the count lives. ExternalStorage puts it in a block next to the object 
+  (BasicSP(new T) or Make), with NoRC there is no block, only the pointer and the deleter. 
+  InlineStorage puts the object and the count in one block (Make only), the pointer is one word. 
+  IntrusiveStorage uses the count inside the object, T derives from the counting class (RefCounted<C>). 
+- Deleter is called on the object when the last reference goes, 
+  an empty deleter like DefaultDeleter takes no space. InlineStorage does not use it. 
+
+The handle of a storage does the counting: copying it adds a reference, destroying it drops one, 
+so BasicSP itself has nothing to write, and the instrumentation (SP_STATS_*) sits in the handles. 
+T may be an array, BasicSP<T[]>(new T[n]) deletes it with delete[] and has operator[]. 
+BasicSP sits beside SP, SP<T[]> and IntrusiveSP, it does not replace them: 
+it has no weak references, no aliasing and no control block which WeakSP or AtomicSP could share, 
+so SP stays the pointer for those and for types which are not known up front. 
+BasicSP<T, AtomicRC, IntrusiveStorage> counts like IntrusiveSP<T> and BasicSP<T[]> deletes like SP<T[]>, 
+but they are separate classes with their own counting code. 
+The aliases at the end are the configurations we use most.
+*/
+class NoRC //counting policy for a single owner, releasing always gives zero
+{
+    public:
+    void AddRef()
+    {
+    }
+
+    int Release()
+    {
+        return 0;
+    }
+
+    int Count() const
+    {
+        return 1;
+    }
+};
+
+template < typename C > struct CountingTraits
+{
+    static const bool Shareable = true; // may the count be shared by more than one handle
+};
+
+template < > struct CountingTraits<NoRC>
+{
+    static const bool Shareable = false;
+};
+
+template < typename D, bool Empty = std::is_empty<D>::value > class DeleterHolder //an empty deleter takes no space
+{
+    private:
+    D deleter;
+
+    protected:
+    DeleterHolder(const D& d) : deleter(d)
+    {
+    }
+
+    D& Deleter()
+    {
+        return deleter;
+    }
+};
+
+template < typename D > class DeleterHolder<D, true> : private D
+{
+    protected:
+    DeleterHolder(const D& d) : D(d)
+    {
+    }
+
+    D& Deleter()
+    {
+        return *this;
+    }
+};
+
+template < typename B > void BindBasicBlock(B*, const void*) //the count never deletes on its own
+{
+}
+
+template < typename B > void DisposeBasicBlock(BiasedRC* rc)
+{
+    static_cast<B*>(rc)->Free();
+}
+
+template < typename B > void BindBasicBlock(B*, BiasedRC* rc) //MergeQueued frees the block of a handle
+{
+    rc->SetDispose(&DisposeBasicBlock<B>);
+}
+
+template < typename T, typename C, typename D > class ExternalHandle //the count in a block of its own
+{
+    private:
+    struct Block : C, DeleterHolder<D>
+    {
+        T* pValue; // the block keeps the pointer too, so it can be freed without a handle (by MergeQueued)
+
+        Block(T* p, const D& d) : DeleterHolder<D>(d), pValue(p)
+        {
+            BindBasicBlock(this, this);
+            SP_STATS_BLOCK(T);
+        }
+
+        void Free()
+        {
+            {
+                SP_STATS_DESTROY(T);
+                this->Deleter()(pValue);
+            }
+            delete this;
+        }
+    };
+
+    T* pData;
+    Block* block;
+
+    public:
+    ExternalHandle() : pData(0), block(0)
+    {
+    }
+
+    ExternalHandle(T* pValue, const D& d) : pData(pValue), block(0)
+    {
+        if (pData)
+        {
+            try
+            {
+                block = new Block(pValue, d);
+            }
+            catch (...)
+            {
+                D deleter(d);
+                deleter(pValue);
+                throw;
+            }
+            block->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    ExternalHandle(const ExternalHandle& h) : pData(h.pData), block(h.block)
+    {
+        if (block)
+        {
+            block->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    ExternalHandle(ExternalHandle&& h) noexcept : pData(h.pData), block(h.block)
+    {
+        h.pData = 0;
+        h.block = 0;
+    }
+
+    ~ExternalHandle()
+    {
+        if (block)
+        {
+            SP_STATS_RELEASE(T);
+            if (block->Release() == 0)
+            {
+                block->Free();
+            }
+        }
+    }
+
+    ExternalHandle& operator = (ExternalHandle h) noexcept //h is a copy or was moved in, swapping it handles self assignment
+    {
+        swap(h);
+        return *this;
+    }
+
+    void swap(ExternalHandle& h) noexcept
+    {
+        std::swap(pData, h.pData);
+        std::swap(block, h.block);
+    }
+
+    template < typename... Args > static ExternalHandle Make(Args&&... args)
+    {
+        return ExternalHandle(new T(std::forward<Args>(args)...), D());
+    }
+
+    T* Get() const
+    {
+        return pData;
+    }
+
+    int Count() const
+    {
+        return block ? block->Count() : 0;
+    }
+};
+
+template < typename T, typename D > class ExternalHandle<T, NoRC, D> : private DeleterHolder<D> //single owner, nothing but the pointer
+{
+    private:
+    T* pData;
+
+    public:
+    ExternalHandle() : DeleterHolder<D>(D()), pData(0)
+    {
+    }
+
+    ExternalHandle(T* pValue, const D& d) : DeleterHolder<D>(d), pData(pValue)
+    {
+    }
+
+    ExternalHandle(const ExternalHandle&) = delete; // one owner, so a BasicSP with NoRC cannot be copied either
+    ExternalHandle& operator = (const ExternalHandle&) = delete;
+
+    ExternalHandle(ExternalHandle&& h) noexcept : DeleterHolder<D>(h.Deleter()), pData(h.pData)
+    {
+        h.pData = 0;
+    }
+
+    ~ExternalHandle()
+    {
+        if (pData)
+        {
+            this->Deleter()(pData);
+        }
+    }
+
+    ExternalHandle& operator = (ExternalHandle&& h) noexcept
+    {
+        ExternalHandle(std::move(h)).swap(*this);
+        return *this;
+    }
+
+    void swap(ExternalHandle& h) noexcept
+    {
+        std::swap(pData, h.pData);
+        std::swap(this->Deleter(), h.Deleter());
+    }
+
+    template < typename... Args > static ExternalHandle Make(Args&&... args)
+    {
+        return ExternalHandle(new T(std::forward<Args>(args)...), D());
+    }
+
+    T* Get() const
+    {
+        return pData;
+    }
+
+    int Count() const
+    {
+        return pData ? 1 : 0;
+    }
+};
+
+template < typename T, typename C, typename D > class InlineHandle //the object and the count in one block
+{
+    static_assert(CountingTraits<C>::Shareable, "a single owner needs no block, use ExternalStorage");
+    static_assert(std::is_same<D, DefaultDeleter<T> >::value, "InlineStorage destroys the object in its block, it takes no deleter");
+
+    private:
+    struct Block : C
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        Block()
+        {
+            BindBasicBlock(this, this);
+        }
+
+        T* Get()
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+
+        void Free()
+        {
+            {
+                SP_STATS_DESTROY(T);
+                Get()->~T();
+            }
+            delete this;
+        }
+    };
+
+    Block* block;
+
+    public:
+    InlineHandle() : block(0)
+    {
+    }
+
+    InlineHandle(const InlineHandle& h) : block(h.block)
+    {
+        if (block)
+        {
+            block->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    InlineHandle(InlineHandle&& h) noexcept : block(h.block)
+    {
+        h.block = 0;
+    }
+
+    ~InlineHandle()
+    {
+        if (block)
+        {
+            SP_STATS_RELEASE(T);
+            if (block->Release() == 0)
+            {
+                block->Free();
+            }
+        }
+    }
+
+    InlineHandle& operator = (InlineHandle h) noexcept
+    {
+        swap(h);
+        return *this;
+    }
+
+    void swap(InlineHandle& h) noexcept
+    {
+        std::swap(block, h.block);
+    }
+
+    template < typename... Args > static InlineHandle Make(Args&&... args)
+    {
+        InlineHandle handle;
+        Block* block = new Block();
+        try
+        {
+            new (block->storage) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            delete block;
+            throw;
+        }
+        SP_STATS_BLOCK(T);
+        block->AddRef();
+        SP_STATS_ADDREF(T);
+        handle.block = block;
+        return handle;
+    }
+
+    T* Get() const
+    {
+        return block ? block->Get() : 0;
+    }
+
+    int Count() const
+    {
+        return block ? block->Count() : 0;
+    }
+};
+
+template < typename T, typename C, typename D > class IntrusiveHandle : private DeleterHolder<D> //the count inside the object
+{
+    static_assert(std::is_base_of<RefCounted<C>, T>::value, "IntrusiveStorage needs T to derive from RefCounted<C>");
+    static_assert(CountingTraits<C>::Shareable, "a single owner has nothing to count in the object, use ExternalStorage");
+    static_assert(!std::is_same<C, BiasedRC>::value || std::is_same<D, DefaultDeleter<T> >::value,
+        "MergeQueued deletes a BiasedRC object with delete, it cannot take a deleter");
+
+    private:
+    T* pData; // there is no block, only AddRef and Release are counted by SP_STATS
+
+    public:
+    IntrusiveHandle() : DeleterHolder<D>(D()), pData(0)
+    {
+    }
+
+    IntrusiveHandle(T* pValue, const D& d) : DeleterHolder<D>(d), pData(pValue)
+    {
+        if (pData)
+        {
+            BindIntrusive(pData, pData);
+            pData->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    IntrusiveHandle(const IntrusiveHandle& h) : DeleterHolder<D>(h), pData(h.pData)
+    {
+        if (pData)
+        {
+            pData->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    IntrusiveHandle(IntrusiveHandle&& h) noexcept : DeleterHolder<D>(h), pData(h.pData)
+    {
+        h.pData = 0;
+    }
+
+    ~IntrusiveHandle()
+    {
+        if (pData)
+        {
+            SP_STATS_RELEASE(T);
+            if (pData->Release() == 0)
+            {
+                this->Deleter()(pData);
+            }
+        }
+    }
+
+    IntrusiveHandle& operator = (IntrusiveHandle h) noexcept
+    {
+        swap(h);
+        return *this;
+    }
+
+    void swap(IntrusiveHandle& h) noexcept
+    {
+        std::swap(pData, h.pData);
+        std::swap(this->Deleter(), h.Deleter());
+    }
+
+    template < typename... Args > static IntrusiveHandle Make(Args&&... args)
+    {
+        return IntrusiveHandle(new T(std::forward<Args>(args)...), D());
+    }
+
+    T* Get() const
+    {
+        return pData;
+    }
+
+    int Count() const
+    {
+        return pData ? pData->Count() : 0;
+    }
+};
+
+struct ExternalStorage
+{
+    template < typename T, typename C, typename D > using Handle = ExternalHandle<T, C, D>;
+};
+
+struct InlineStorage
+{
+    template < typename T, typename C, typename D > using Handle = InlineHandle<T, C, D>;
+};
+
+struct IntrusiveStorage
+{
+    template < typename T, typename C, typename D > using Handle = IntrusiveHandle<T, C, D>;
+};
+
+template < typename T, typename C = RC, typename S = ExternalStorage, typename D = DefaultDeleter<T> > class BasicSP
+{
+private:
+    typedef typename std::remove_extent<T>::type E; // T, or the element type when T is an array
+    typedef typename S::template Handle<E, C, D> Handle;
+
+    Handle handle; // everything BasicSP holds, copying, moving and destroying it does the counting
+
+    explicit BasicSP(Handle&& h) : handle(std::move(h))
+    {
+    }
+
+public:
+    BasicSP()
+    {
+    }
+
+    explicit BasicSP(E* pValue, const D& deleter = D()) : handle(pValue, deleter) //every storage but InlineStorage
+    {
+    }
+
+    template < typename... Args > static BasicSP Make(Args&&... args) //every storage, the only way for InlineStorage
+    {
+        static_assert(!std::is_array<T>::value, "an array comes from new T[n]");
+        return BasicSP(Handle::Make(std::forward<Args>(args)...));
+    }
+
+    E& operator* () const
+    {
+        return *handle.Get();
+    }
+
+    E* operator-> () const
+    {
+        return handle.Get();
+    }
+
+    E& operator[] (size_t i) const //for BasicSP<T[]>
+    {
+        return handle.Get()[i];
+    }
+
+    explicit operator bool () const
+    {
+        return handle.Get() != 0;
+    }
+
+    int use_count() const
+    {
+        return handle.Count();
+    }
+
+    void swap(BasicSP& sp) noexcept
+    {
+        handle.swap(sp.handle);
+    }
+};
+
+template < typename T > using ScopedSP = BasicSP<T, NoRC>;                           // one owner, as small as a pointer
+template < typename T > using LocalSP = BasicSP<T, RC, InlineStorage>;               // shared within one thread
+template < typename T > using SharedSP = BasicSP<T, AtomicRC, InlineStorage>;        // shared between threads
+template < typename T > using IntrusiveSharedSP = BasicSP<T, AtomicRC, IntrusiveStorage>; // T derives from RefCounted<AtomicRC>
+template < typename T > using BiasedSP = BasicSP<T, BiasedRC, InlineStorage>;        // mostly on its owner thread, see BiasedRC
+
+//Client code to use policy based smart pointers
+void main()
+{
+    static_assert(sizeof(ScopedSP<Person>) == sizeof(Person*), "no block and no deleter");
+    static_assert(sizeof(LocalSP<Person>) == sizeof(void*), "only the block pointer");
+    static_assert(sizeof(IntrusiveSharedSP<SharedPerson>) == sizeof(void*), "only the object pointer");
+
+    ScopedSP<Person> owner(new Person("Scott", 25));
+    ScopedSP<Person> moved = std::move(owner); //ScopedSP<Person> copy = moved; would not compile
+    moved->Display();
+
+    LocalSP<Person> p = LocalSP<Person>::Make("Bob", 40); //person and count in one block
+    LocalSP<Person> q = p;
+    printf("%d share Bob\n", q.use_count());
+
+    SharedSP<Person> shared = SharedSP<Person>::Make("Alice", 35);
+    std::thread worker([shared]() { shared->Display(); });
+    worker.join();
+
+    IntrusiveSharedSP<SharedPerson> intrusive(new SharedPerson("Joe", 30));
+    IntrusiveSharedSP<SharedPerson> again = intrusive;
+    again->Display();
+
+    static_assert(!std::is_copy_constructible< ScopedSP<Person> >::value, "one owner");
+    Person* three = new Person[3];
+    BasicSP<Person[]> people(three); //deleted with delete[]
+    people[1].Display();
+
+    BiasedSP<Person> biased = BiasedSP<Person>::Make("Ann", 28);
+    std::thread reader([biased]() { biased->Display(); }); //its reference may be the last one
+    reader.join();
+    biased = BiasedSP<Person>();
+    BiasedRC::MergeQueued();
+}
+
+//Keeping counts on cache lines of their own
+/**
+A cache line (64 bytes) is the unit in which cores share memory. When the count of one block 
+shares a line with the count of another block or with fields of the object which are written a lot, 
+every AddRef and Release on one core takes the line away from the other cores which use the rest of it, 
+although they never touch the same bytes (false sharing). 
+CacheAlignedRC<R> is the counting class R aligned to and padded up to a whole line 
+(with pad bytes up to the end of the line, alignas alone leaves padding which the object may be put into), 
+so in RCBlock<CacheAlignedRC<R>> the count is alone on its line: 
+make_SP puts the object on the next line, and two blocks, pooled or not, never share one. 
+It costs memory (a block with a person takes three lines instead of one), 
+so use it for the few objects which many threads count and write at the same time: 
+SP<Person, CacheAlignedRC<AtomicRC> >. Line is 64 by default, 
+128 where the CPU fetches lines in pairs (the adjacent line prefetch of many Intel servers). 
+The blocks come from aligned new, and BlockPool keeps the alignment as well.
+*/
+template < size_t Size > struct CachePad //real bytes, the compiler may put a derived class's members into mere alignment padding
+{
+    char pad[Size];
+};
+
+template < > struct CachePad<0> //R ends on a line already, nothing to fill
+{
+};
+
+template < typename R, size_t Line = 64 > class alignas(Line) CacheAlignedRC : public R, private CachePad<(Line - sizeof(R) % Line) % Line>
+{
+};
+
+template < typename R, size_t Line > struct ThreadSafeRC< CacheAlignedRC<R, Line> > : ThreadSafeRC<R> //as safe as the count it wraps
+{
+};
+
+struct HotCounter //an object whose field one thread keeps writing
+{
+    std::atomic<long long> value;
+
+    HotCounter() : value(0)
+    {
+    }
+};
+
+template < typename R > void BenchSharing(const char* pName, int threads, long ops)
+{
+    char name[64];
+    std::vector<R> counts(threads); // each thread counts its own, but they sit next to each other
+    std::atomic<int> next(0);
+
+    snprintf(name, sizeof(name), "%s counts side by side", pName);
+    Bench(name, threads, ops, [&counts, &next](long n)
+    {
+        R& count = counts[next.fetch_add(1)];
+        for (long i = 0; i < n; i++)
+        {
+            count.AddRef();
+            count.Release();
+        }
+    });
+
+    SP<HotCounter, R> hot = make_SP<HotCounter, R>();
+    std::vector< SP<HotCounter, R> > copies(threads, hot); // made up front, the loops never write the count
+    next.store(0);
+    snprintf(name, sizeof(name), "%s count next to payload", pName);
+    Bench(name, threads, ops, [&copies, &next](long n)
+    {
+        SP<HotCounter, R>& mine = copies[next.fetch_add(1)];
+        if (&mine == &copies[0])
+        {
+            for (long i = 0; i < n; i++) //one writer of the payload
+            {
+                mine->value.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        long long shared = 0;
+        for (long i = 0; i < n; i++) //and the others only read the count
+        {
+            shared += mine.use_count();
+            BenchFence();
+        }
+        if (shared != (long long)n * (long long)copies.size() + n)
+        {
+            printf("wrong count %lld\n", shared); //also keeps the loads
+        }
+    });
+}
+
+//Client code to measure false sharing of counts
+void main()
+{
+    const long ops = 1000000;
+    int threads = (int)std::thread::hardware_concurrency();
+    threads = threads < 2 ? 2 : threads > 8 ? 8 : threads;
+
+    static_assert(sizeof(CacheAlignedRC<AtomicRC>) == 64, "one count per line");
+    static_assert(alignof(RCInplace<HotCounter, CacheAlignedRC<AtomicRC> >) == 64, "blocks start on a line");
+
+    BenchSharing<AtomicRC>("AtomicRC", threads, ops);
+    BenchSharing< CacheAlignedRC<AtomicRC> >("CacheAlignedRC<AtomicRC>", threads, ops);
+
+    if (BenchGate::Get().Finish() != 0)
+    {
+        exit(1);
+    }
+}
+
+//Handing a smart pointer on
+/**
+An SP copied into a coroutine frame, a lambda or a queue costs an AddRef, 
+and one more Release when the copy goes away, although the sender never uses its own copy again. 
+UniqueSP is the owner of a new object while nobody else has it: it can only be moved, 
+the count in its block is one and stays one, and destroying it deletes the object 
+without looking at the count (nobody else can hold a reference). 
+When the object is to be shared, std::move(unique) or Share() turns it into an SP 
+which takes over the block and its count: no AddRef, no Release, no new block. 
+
+For coroutines the rule is the same as for threads: move the pointer, do not copy it. 
+A parameter SP<T, R> taken by value and filled with std::move goes into the frame for nothing, 
+and a const SP& parameter would dangle as soon as the coroutine is resumed somewhere else. 
+SPHandoff passes one SP to a coroutine which co_awaits it, from any thread: 
+Send moves the pointer into the handoff and resumes the coroutine on the sending thread, 
+where await_resume moves it out again, so the count is not touched on the way. 
+It needs C++20 coroutines (__cpp_impl_coroutine), UniqueSP does not.
+*/
+template < typename T, typename R = RC > class UniqueSP
+{
+private:
+    T*    pData;
+    RCBlock<R>* reference; // its count is one, and that one is ours
+
+    void Delete()
+    {
+        if (reference)
+        {
+            SP_STATS_RELEASE(T);
+            reference->Dispose();
+            if (reference->ReleaseWeak() == 0) //there is no WeakSP, nobody could make one
+            {
+                reference->Destroy();
+            }
+        }
+    }
+
+public:
+    UniqueSP() : pData(0), reference(0)
+    {
+    }
+
+    explicit UniqueSP(T* pValue) : pData(pValue), reference(0)
+    {
+        if (pData)
+        {
+            try
+            {
+                reference = new RCPointer<T, R>(pData);
+            }
+            catch (...)
+            {
+                delete pValue;
+                throw;
+            }
+            reference->AddRef();
+            SP_STATS_ADDREF(T);
+        }
+    }
+
+    UniqueSP(T* pValue, RCBlock<R>* block) : pData(pValue), reference(block) //used by make_UniqueSP
+    {
+        reference->AddRef();
+        SP_STATS_ADDREF(T);
+    }
+
+    UniqueSP(UniqueSP<T, R>&& sp) noexcept : pData(sp.pData), reference(sp.reference)
+    {
+        sp.pData = 0;
+        sp.reference = 0;
+    }
+
+    UniqueSP(const UniqueSP<T, R>&) = delete;
+    UniqueSP<T, R>& operator = (const UniqueSP<T, R>&) = delete;
+
+    ~UniqueSP()
+    {
+        Delete();
+    }
+
+    UniqueSP<T, R>& operator = (UniqueSP<T, R>&& sp) noexcept
+    {
+        UniqueSP<T, R>(std::move(sp)).swap(*this);
+        return *this;
+    }
+
+    T& operator* () const
+    {
+        return *pData;
+    }
+
+    T* operator-> () const
+    {
+        return pData;
+    }
+
+    explicit operator bool () const
+    {
+        return pData != 0;
+    }
+
+    SP<T, R> Share() //the SP takes our block and our count, we are empty afterwards
+    {
+        SP<T, R> sp;
+        sp.pData = pData;
+        sp.reference = reference;
+        pData = 0;
+        reference = 0;
+        return sp;
+    }
+
+    operator SP<T, R> () && //SP<T, R> p = std::move(unique);
+    {
+        return Share();
+    }
+
+    void swap(UniqueSP<T, R>& sp) noexcept
+    {
+        std::swap(pData, sp.pData);
+        std::swap(reference, sp.reference);
+    }
+};
+
+template < typename T, typename R = RC, typename... Args > UniqueSP<T, R> make_UniqueSP(Args&&... args)
+{
+    RCInplace<T, R>* block = new RCInplace<T, R>(std::forward<Args>(args)...);
+    return UniqueSP<T, R>(block->Get(), static_cast<RCBlock<R>*>(block));
+}
+
+#ifdef __cpp_impl_coroutine
+template < typename T, typename R = RC > class SPHandoff //one SP for one coroutine which waits for it
+{
+    private:
+    std::mutex lock;
+    SP<T, R> value;
+    bool ready;                     // value was sent and not taken yet
+    std::coroutine_handle<> waiter; // the coroutine suspended in Receive
+
+    public:
+    class Awaiter
+    {
+        private:
+        SPHandoff<T, R>& handoff;
+
+        public:
+        Awaiter(SPHandoff<T, R>& h) : handoff(h)
+        {
+        }
+
+        bool await_ready()
+        {
+            std::lock_guard<std::mutex> guard(handoff.lock);
+            return handoff.ready;
+        }
+
+        bool await_suspend(std::coroutine_handle<> coroutine)
+        {
+            std::lock_guard<std::mutex> guard(handoff.lock);
+            if (handoff.ready)
+            {
+                return false; // sent in the meantime, go on right away
+            }
+            handoff.waiter = coroutine;
+            return true;
+        }
+
+        SP<T, R> await_resume()
+        {
+            std::lock_guard<std::mutex> guard(handoff.lock);
+            handoff.ready = false;
+            return std::move(handoff.value);
+        }
+    };
+
+    SPHandoff() : ready(false)
+    {
+    }
+
+    void Send(SP<T, R> sp) //move the pointer in, a waiting coroutine goes on on this thread
+    {
+        std::coroutine_handle<> coroutine;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            value = std::move(sp);
+            ready = true;
+            coroutine = waiter;
+            waiter = nullptr;
+        }
+        if (coroutine)
+        {
+            coroutine.resume();
+        }
+    }
+
+    Awaiter Receive() //co_await handoff.Receive() gives the SP which was sent
+    {
+        return Awaiter(*this);
+    }
+};
+
+struct DetachedCoroutine //a coroutine nobody waits for, its frame goes away when it ends
+{
+    struct promise_type
+    {
+        DetachedCoroutine get_return_object()
+        {
+            return DetachedCoroutine();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+DetachedCoroutine ServePerson(SPHandoff<Person, AtomicRC>& handoff) //handoff must outlive the coroutine
+{
+    SP<Person, AtomicRC> p = co_await handoff.Receive(); //moved out of the handoff, no AddRef
+    p->Display();
+    // the person is deleted here, on whatever thread resumed us
+}
+#endif
+
+//Client code to hand smart pointers on
+void main()
+{
+    UniqueSP<Person, AtomicRC> unique = make_UniqueSP<Person, AtomicRC>("Scott", 25);
+    unique->Age() += 20; //nobody else can see the person yet
+    SP<Person, AtomicRC> shared = std::move(unique); //takes the count over, no atomic operation
+    printf("%d owner\n", shared.use_count());
+
+#ifdef __cpp_impl_coroutine
+    SPHandoff<Person, AtomicRC> handoff;
+    ServePerson(handoff); //suspends until the person arrives
+    UniqueSP<Person, AtomicRC> bob = make_UniqueSP<Person, AtomicRC>("Bob", 40);
+    std::thread sender([&handoff, &bob]()
+    {
+        handoff.Send(std::move(bob)); //the coroutine goes on here, on the sender's thread
+    });
+    sender.join();
+#endif
+}
@@ -1,42 +1,2058 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+In this exercise you'll learn how to make a struct,
+point a pointer at them, and use them to make sense of internal memory structures.
+*/
+
+/**
+Built with SP_BENCH, the person code allocates through Person_malloc, Person_realloc and Person_strdup, 
+which count the allocations in Person_allocations for the benchmark (see PersonBench_run). 
+The count is atomic, so threads may allocate at the same time. 
+Without SP_BENCH the three are plain malloc, realloc and strdup, and nothing is counted.
+*/
+#ifdef SP_BENCH
+size_t Person_allocations = 0;
+
+void *Person_malloc(size_t size)
+{
+    __atomic_fetch_add(&Person_allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *Person_realloc(void *p, size_t size)
+{
+    __atomic_fetch_add(&Person_allocations, 1, __ATOMIC_RELAXED);
+    return realloc(p, size);
+}
+
+char *Person_strdup(const char *text)
+{
+    __atomic_fetch_add(&Person_allocations, 1, __ATOMIC_RELAXED);
+    return strdup(text);
+}
+#else
+#define Person_malloc malloc
+#define Person_realloc realloc
+#define Person_strdup strdup
+#endif
+
+/**
+Names shorter than PERSON_NAME_INLINE are kept inside the struct itself, 
+name then points at name_inline and no strdup is needed. 
+Only longer names go to the heap. 
+Because name may point into the struct, copy a person with Person_create, never with *a = *b.
+*/
+#define PERSON_NAME_INLINE 24
+
+struct Person {
+    char *name;
+    int age;
+    int height;
+    int weight;
+    char name_inline[PERSON_NAME_INLINE];
+};
+
+struct Person *Person_create(char *name, int age, int height, int weight)
+{
+    struct Person *who = Person_malloc(sizeof(struct Person));
+    assert(who != NULL);
+
+    size_t name_size = strlen(name) + 1;
+    if (name_size <= PERSON_NAME_INLINE) {
+        who->name = who->name_inline;
+        memcpy(who->name, name, name_size);
+    } else {
+        who->name = Person_strdup(name);
+    }
+    who->age = age;
+    who->height = height;
+    who->weight = weight;
+
+    return who;
+}
+
+void Person_destroy(struct Person *who)
+{
+    assert(who != NULL);
+
+    if (who->name != who->name_inline) {
+        free(who->name);
+    }
+    free(who);
+}
+
+void Person_print(struct Person *who)
+{
+    printf("Name: %s\n", who->name);
+    printf("\tAge: %d\n", who->age);
+    printf("\tHeight: %d\n", who->height);
+    printf("\tWeight: %d\n", who->weight);
+}
+
+/**
+Person_create does two mallocs (the struct and the strdup of the name) 
+and Person_destroy two frees, for every single record. 
+A PersonArena hands out memory from big chunks instead: 
+PersonArena_alloc_person just bumps a pointer and puts a long name right behind the struct, 
+and PersonArena_reset throws away every person of the arena at once, in O(1). 
+The chunks are kept and reused by the next batch, PersonArena_destroy gives them back. 
+Never call Person_destroy on a person which came from an arena.
+*/
+
+#define PERSON_ARENA_ALIGN sizeof(void *)  // enough for struct Person
+
+struct PersonArenaChunk {
+    struct PersonArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct PersonArena {
+    struct PersonArenaChunk *first;
+    struct PersonArenaChunk *current;
+    size_t chunk_size;
+};
+
+struct PersonArenaChunk *PersonArenaChunk_create(size_t size, struct PersonArenaChunk *next)
+{
+    struct PersonArenaChunk *chunk = Person_malloc(sizeof(struct PersonArenaChunk) + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+struct PersonArena *PersonArena_create(size_t chunk_size)
+{
+    struct PersonArena *arena = Person_malloc(sizeof(struct PersonArena));
+    assert(arena != NULL);
+
+    arena->chunk_size = chunk_size;
+    arena->first = PersonArenaChunk_create(chunk_size, NULL);
+    assert(arena->first != NULL);
+    arena->current = arena->first;
+
+    return arena;
+}
+
+// NULL if a new chunk was needed and there is no memory for it
+void *PersonArena_alloc(struct PersonArena *arena, size_t size)
+{
+    struct PersonArenaChunk *chunk = arena->current;
+
+    size = (size + PERSON_ARENA_ALIGN - 1) & ~(PERSON_ARENA_ALIGN - 1);
+    if (chunk->used + size > chunk->size) {
+        // move on to the next chunk, reuse it if it is big enough
+        struct PersonArenaChunk *next = chunk->next;
+        if (next == NULL || next->size < size) {
+            next = PersonArenaChunk_create(
+                    size > arena->chunk_size ? size : arena->chunk_size, next);
+            if (next == NULL) {
+                return NULL;
+            }
+            chunk->next = next;
+        }
+        next->used = 0;
+        arena->current = chunk = next;
+    }
+
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+struct Person *PersonArena_alloc_person(struct PersonArena *arena,
+        char *name, int age, int height, int weight)
+{
+    size_t name_size = strlen(name) + 1;
+    size_t extra = name_size <= PERSON_NAME_INLINE ? 0 : name_size;
+    struct Person *who = PersonArena_alloc(arena, sizeof(struct Person) + extra);
+    if (who == NULL) {
+        return NULL;
+    }
+
+    // a long name lives right behind the struct
+    who->name = extra == 0 ? who->name_inline : (char *)(who + 1);
+    memcpy(who->name, name, name_size);
+    who->age = age;
+    who->height = height;
+    who->weight = weight;
+
+    return who;
+}
+
+void PersonArena_reset(struct PersonArena *arena)
+{
+    // later chunks are rewound when the arena gets to them again
+    arena->current = arena->first;
+    arena->first->used = 0;
+}
+
+void PersonArena_destroy(struct PersonArena *arena)
+{
+    assert(arena != NULL);
+
+    struct PersonArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        struct PersonArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/**
+An array of struct Person pointers mixes every field of a record together, 
+so "make everyone 20 years older" has to jump from struct to struct. 
+A PersonTable keeps each field in its own contiguous array (structure of arrays) 
+and all the names in one shared pool, a row number identifies a person. 
+The batch updates are then simple loops over one array of ints 
+which the compiler can vectorize and which stream through memory. 
+A name returned by PersonTable_name is only valid until the next PersonTable_add.
+*/
+
+struct PersonTable {
+    int *ages;
+    int *heights;
+    int *weights;
+    size_t *name_offsets;  // where the name of each row starts in names
+    char *names;           // shared pool of '\0' terminated names
+    size_t count;
+    size_t capacity;
+    size_t names_used;
+    size_t names_capacity;
+};
+
+struct PersonTable *PersonTable_create(size_t capacity)
+{
+    struct PersonTable *table = Person_malloc(sizeof(struct PersonTable));
+    assert(table != NULL);
+
+    if (capacity == 0) {
+        capacity = 16;
+    }
+    table->ages = Person_malloc(capacity * sizeof(int));
+    table->heights = Person_malloc(capacity * sizeof(int));
+    table->weights = Person_malloc(capacity * sizeof(int));
+    table->name_offsets = Person_malloc(capacity * sizeof(size_t));
+    table->names_capacity = capacity * 16;
+    table->names = Person_malloc(table->names_capacity);
+    assert(table->ages != NULL && table->heights != NULL && table->weights != NULL);
+    assert(table->name_offsets != NULL && table->names != NULL);
+
+    table->count = 0;
+    table->capacity = capacity;
+    table->names_used = 0;
+
+    return table;
+}
+
+void PersonTable_destroy(struct PersonTable *table)
+{
+    assert(table != NULL);
+
+    free(table->ages);
+    free(table->heights);
+    free(table->weights);
+    free(table->name_offsets);
+    free(table->names);
+    free(table);
+}
+
+size_t PersonTable_add(struct PersonTable *table,
+        char *name, int age, int height, int weight)
+{
+    size_t name_size = strlen(name) + 1;
+
+    if (table->count == table->capacity) {
+        table->capacity *= 2;
+        table->ages = Person_realloc(table->ages, table->capacity * sizeof(int));
+        table->heights = Person_realloc(table->heights, table->capacity * sizeof(int));
+        table->weights = Person_realloc(table->weights, table->capacity * sizeof(int));
+        table->name_offsets = Person_realloc(table->name_offsets,
+                table->capacity * sizeof(size_t));
+        assert(table->ages != NULL && table->heights != NULL);
+        assert(table->weights != NULL && table->name_offsets != NULL);
+    }
+    if (table->names_used + name_size > table->names_capacity) {
+        while (table->names_used + name_size > table->names_capacity) {
+            table->names_capacity *= 2;
+        }
+        table->names = Person_realloc(table->names, table->names_capacity);
+        assert(table->names != NULL);
+    }
+
+    size_t row = table->count++;
+    table->ages[row] = age;
+    table->heights[row] = height;
+    table->weights[row] = weight;
+    table->name_offsets[row] = table->names_used;
+    memcpy(table->names + table->names_used, name, name_size);
+    table->names_used += name_size;
+
+    return row;
+}
+
+char *PersonTable_name(struct PersonTable *table, size_t row)
+{
+    assert(row < table->count);
+    return table->names + table->name_offsets[row];
+}
+
+void PersonTable_add_column(int *column, size_t count, int delta)
+{
+    for (size_t i = 0; i < count; i++) {
+        column[i] += delta;
+    }
+}
+
+void PersonTable_add_age(struct PersonTable *table, int delta)
+{
+    PersonTable_add_column(table->ages, table->count, delta);
+}
+
+void PersonTable_add_height(struct PersonTable *table, int delta)
+{
+    PersonTable_add_column(table->heights, table->count, delta);
+}
+
+void PersonTable_add_weight(struct PersonTable *table, int delta)
+{
+    PersonTable_add_column(table->weights, table->count, delta);
+}
+
+void PersonTable_print(struct PersonTable *table, size_t row)
+{
+    printf("Name: %s\n", PersonTable_name(table, row));
+    printf("\tAge: %d\n", table->ages[row]);
+    printf("\tHeight: %d\n", table->heights[row]);
+    printf("\tWeight: %d\n", table->weights[row]);
+}
+
+/**
+The queries over a PersonTable only look at one int column at a time, 
+so they can run on 4, 8 or 16 rows at once with SSE4.1, AVX2 or AVX-512. 
+PersonTable_filter_age sets bit i of bitmap (one uint64_t per 64 rows) when row i is in [min, max], 
+PersonTable_column_stats gives the sum, min and max of a column (table->heights, table->weights, ...). 
+The fastest version the CPU supports is picked (with pthread_once) the first time a kernel is called, 
+with a plain C version for other CPUs and compilers. 
+PersonTable_column_histogram stays scalar on every CPU: 
+the increments go to random buckets, which does not vectorize.
+*/
+
+struct PersonColumnStats {
+    long long sum;
+    int min;
+    int max;
+};
+
+struct PersonKernels {
+    void (*filter_range)(const int *column, size_t count,
+            int min, int max, uint64_t *bitmap);
+    void (*stats)(const int *column, size_t count,
+            struct PersonColumnStats *stats);
+};
+
+// a value is in [min, max] when (unsigned)(value - min) <= (unsigned)(max - min)
+void PersonKernels_filter_range_scalar(const int *column, size_t count,
+        int min, int max, uint64_t *bitmap)
+{
+    unsigned int limit = (unsigned int)max - (unsigned int)min;
+
+    for (size_t i = 0; i < count; i += 64) {
+        size_t n = count - i < 64 ? count - i : 64;
+        uint64_t word = 0;
+        for (size_t j = 0; j < n; j++) {
+            unsigned int offset = (unsigned int)column[i + j] - (unsigned int)min;
+            word |= (uint64_t)(offset <= limit) << j;
+        }
+        bitmap[i / 64] = word;
+    }
+}
+
+void PersonKernels_stats_scalar(const int *column, size_t count,
+        struct PersonColumnStats *stats)
+{
+    for (size_t i = 0; i < count; i++) {
+        stats->sum += column[i];
+        stats->min = column[i] < stats->min ? column[i] : stats->min;
+        stats->max = column[i] > stats->max ? column[i] : stats->max;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("sse4.1")))
+void PersonKernels_filter_range_sse(const int *column, size_t count,
+        int min, int max, uint64_t *bitmap)
+{
+    // SSE has no unsigned compare, flipping the sign bit turns it into a signed one
+    __m128i sign = _mm_set1_epi32((int)0x80000000);
+    __m128i low = _mm_set1_epi32(min);
+    __m128i limit = _mm_xor_si128(_mm_set1_epi32((int)((unsigned int)max - (unsigned int)min)), sign);
+    size_t i = 0;
+
+    for (; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 64; j += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(column + i + j));
+            __m128i offset = _mm_xor_si128(_mm_sub_epi32(v, low), sign);
+            __m128i outside = _mm_cmpgt_epi32(offset, limit);
+            word |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xF) << j;
+        }
+        bitmap[i / 64] = word;
+    }
+    PersonKernels_filter_range_scalar(column + i, count - i, min, max, bitmap + i / 64);
+}
+
+__attribute__((target("sse4.1")))
+void PersonKernels_stats_sse(const int *column, size_t count,
+        struct PersonColumnStats *stats)
+{
+    __m128i sum = _mm_setzero_si128();
+    __m128i min = _mm_set1_epi32(stats->min);
+    __m128i max = _mm_set1_epi32(stats->max);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(column + i));
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(v));
+        sum = _mm_add_epi64(sum, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+        min = _mm_min_epi32(min, v);
+        max = _mm_max_epi32(max, v);
+    }
+
+    long long sums[2];
+    int mins[4], maxs[4];
+    _mm_storeu_si128((__m128i *)sums, sum);
+    _mm_storeu_si128((__m128i *)mins, min);
+    _mm_storeu_si128((__m128i *)maxs, max);
+    stats->sum += sums[0] + sums[1];
+    for (int j = 0; j < 4; j++) {
+        stats->min = mins[j] < stats->min ? mins[j] : stats->min;
+        stats->max = maxs[j] > stats->max ? maxs[j] : stats->max;
+    }
+    PersonKernels_stats_scalar(column + i, count - i, stats);
+}
+
+__attribute__((target("avx2")))
+void PersonKernels_filter_range_avx2(const int *column, size_t count,
+        int min, int max, uint64_t *bitmap)
+{
+    __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    __m256i low = _mm256_set1_epi32(min);
+    __m256i limit = _mm256_xor_si256(_mm256_set1_epi32((int)((unsigned int)max - (unsigned int)min)), sign);
+    size_t i = 0;
+
+    for (; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 64; j += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(column + i + j));
+            __m256i offset = _mm256_xor_si256(_mm256_sub_epi32(v, low), sign);
+            __m256i outside = _mm256_cmpgt_epi32(offset, limit);
+            word |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFF) << j;
+        }
+        bitmap[i / 64] = word;
+    }
+    PersonKernels_filter_range_scalar(column + i, count - i, min, max, bitmap + i / 64);
+}
+
+__attribute__((target("avx2")))
+void PersonKernels_stats_avx2(const int *column, size_t count,
+        struct PersonColumnStats *stats)
+{
+    __m256i sum = _mm256_setzero_si256();
+    __m256i min = _mm256_set1_epi32(stats->min);
+    __m256i max = _mm256_set1_epi32(stats->max);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(column + i));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+        min = _mm256_min_epi32(min, v);
+        max = _mm256_max_epi32(max, v);
+    }
+
+    long long sums[4];
+    int mins[8], maxs[8];
+    _mm256_storeu_si256((__m256i *)sums, sum);
+    _mm256_storeu_si256((__m256i *)mins, min);
+    _mm256_storeu_si256((__m256i *)maxs, max);
+    stats->sum += sums[0] + sums[1] + sums[2] + sums[3];
+    for (int j = 0; j < 8; j++) {
+        stats->min = mins[j] < stats->min ? mins[j] : stats->min;
+        stats->max = maxs[j] > stats->max ? maxs[j] : stats->max;
+    }
+    PersonKernels_stats_scalar(column + i, count - i, stats);
+}
+
+__attribute__((target("avx512f")))
+void PersonKernels_filter_range_avx512(const int *column, size_t count,
+        int min, int max, uint64_t *bitmap)
+{
+    // AVX-512 compares unsigned and gives the bits directly
+    __m512i low = _mm512_set1_epi32(min);
+    __m512i limit = _mm512_set1_epi32((int)((unsigned int)max - (unsigned int)min));
+    size_t i = 0;
+
+    for (; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 64; j += 16) {
+            __m512i v = _mm512_loadu_si512((const void *)(column + i + j));
+            word |= (uint64_t)_mm512_cmple_epu32_mask(_mm512_sub_epi32(v, low), limit) << j;
+        }
+        bitmap[i / 64] = word;
+    }
+    PersonKernels_filter_range_scalar(column + i, count - i, min, max, bitmap + i / 64);
+}
+
+__attribute__((target("avx512f")))
+void PersonKernels_stats_avx512(const int *column, size_t count,
+        struct PersonColumnStats *stats)
+{
+    __m512i sum = _mm512_setzero_si512();
+    __m512i min = _mm512_set1_epi32(stats->min);
+    __m512i max = _mm512_set1_epi32(stats->max);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void *)(column + i));
+        sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+        sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+        min = _mm512_min_epi32(min, v);
+        max = _mm512_max_epi32(max, v);
+    }
+
+    stats->sum += _mm512_reduce_add_epi64(sum);
+    int vmin = _mm512_reduce_min_epi32(min);
+    int vmax = _mm512_reduce_max_epi32(max);
+    stats->min = vmin < stats->min ? vmin : stats->min;
+    stats->max = vmax > stats->max ? vmax : stats->max;
+    PersonKernels_stats_scalar(column + i, count - i, stats);
+}
+
+struct PersonKernels PersonKernels_select(void)
+{
+    struct PersonKernels kernels = {
+        PersonKernels_filter_range_scalar, PersonKernels_stats_scalar
+    };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.filter_range = PersonKernels_filter_range_avx512;
+        kernels.stats = PersonKernels_stats_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        kernels.filter_range = PersonKernels_filter_range_avx2;
+        kernels.stats = PersonKernels_stats_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        kernels.filter_range = PersonKernels_filter_range_sse;
+        kernels.stats = PersonKernels_stats_sse;
+    }
+    return kernels;
+}
+#else
+struct PersonKernels PersonKernels_select(void)
+{
+    struct PersonKernels kernels = {
+        PersonKernels_filter_range_scalar, PersonKernels_stats_scalar
+    };
+    return kernels;
+}
+#endif
+
+static struct PersonKernels PersonKernels_chosen;
+static pthread_once_t PersonKernels_once = PTHREAD_ONCE_INIT;
+
+static void PersonKernels_choose(void)
+{
+    PersonKernels_chosen = PersonKernels_select();
+}
+
+struct PersonKernels *PersonKernels_get(void)
+{
+    // selected exactly once, and every caller sees the kernels written before it returns
+    pthread_once(&PersonKernels_once, PersonKernels_choose);
+    return &PersonKernels_chosen;
+}
+
+void PersonTable_filter_age(struct PersonTable *table, int min, int max,
+        uint64_t *bitmap)
+{
+    if (max < min) {
+        memset(bitmap, 0, (table->count + 63) / 64 * sizeof(uint64_t));
+        return;
+    }
+    PersonKernels_get()->filter_range(table->ages, table->count, min, max, bitmap);
+}
+
+void PersonTable_column_stats(const int *column, size_t count,
+        struct PersonColumnStats *stats)
+{
+    stats->sum = 0;
+    stats->min = INT_MAX;
+    stats->max = INT_MIN;
+    PersonKernels_get()->stats(column, count, stats);
+}
+
+// counts the values in [low, low + bucket_width * bucket_count), one bucket per bucket_width
+void PersonTable_column_histogram(const int *column, size_t count,
+        int low, int bucket_width, size_t *buckets, size_t bucket_count)
+{
+    assert(bucket_width > 0);
+
+    memset(buckets, 0, bucket_count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        long long offset = (long long)column[i] - low;
+        if (offset >= 0 && offset / bucket_width < (long long)bucket_count) {
+            buckets[offset / bucket_width]++;
+        }
+    }
+}
+
+/**
+Person_print does four printf calls per person, each one locks stdout and parses its format. 
+Person_format_batch renders many people into one caller supplied buffer instead, 
+with the same bytes as Person_print, and Person_write_batch sends every full buffer 
+to a file descriptor with a single write. 
+The buffer must hold at least one record: the name plus PERSON_FORMAT_FIXED bytes. 
+Call fflush(stdout) first when mixing it with printf on the same descriptor.
+*/
+
+// "Name: \n\tAge: \n\tHeight: \n\tWeight: \n" plus room for three ints
+#define PERSON_FORMAT_FIXED (34 + 3 * 11)
+
+char *Person_format_int(char *out, int value)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[12];
+    char *p = digits + sizeof(digits);
+    unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    // two digits per division
+    while (u >= 100) {
+        unsigned int pair = (u % 100) * 2;
+        u /= 100;
+        *--p = pairs[pair + 1];
+        *--p = pairs[pair];
+    }
+    if (u >= 10) {
+        *--p = pairs[u * 2 + 1];
+        *--p = pairs[u * 2];
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    size_t length = digits + sizeof(digits) - p;
+    memcpy(out, p, length);
+    return out + length;
+}
+
+char *Person_format_text(char *out, const char *text, size_t length)
+{
+    memcpy(out, text, length);
+    return out + length;
+}
+
+size_t Person_format(struct Person *who, char *buf)
+{
+    char *p = buf;
+
+    p = Person_format_text(p, "Name: ", 6);
+    p = Person_format_text(p, who->name, strlen(who->name));
+    p = Person_format_text(p, "\n\tAge: ", 7);
+    p = Person_format_int(p, who->age);
+    p = Person_format_text(p, "\n\tHeight: ", 10);
+    p = Person_format_int(p, who->height);
+    p = Person_format_text(p, "\n\tWeight: ", 10);
+    p = Person_format_int(p, who->weight);
+    *p++ = '\n';
+
+    return p - buf;
+}
+
+// formats people until the buffer is full, *formatted tells how many made it
+size_t Person_format_batch(struct Person **people, size_t count,
+        char *buf, size_t size, size_t *formatted)
+{
+    size_t used = 0;
+    size_t i = 0;
+
+    for (; i < count; i++) {
+        if (used + strlen(people[i]->name) + PERSON_FORMAT_FIXED > size) {
+            break;
+        }
+        used += Person_format(people[i], buf + used);
+    }
+    *formatted = i;
+    return used;
+}
+
+int Person_write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int Person_write_batch(int fd, struct Person **people, size_t count,
+        char *buf, size_t size)
+{
+    while (count > 0) {
+        size_t formatted;
+        size_t used = Person_format_batch(people, count, buf, size, &formatted);
+        if (formatted == 0) {
+            return -1;  // the buffer cannot hold even one person
+        }
+        if (Person_write_all(fd, buf, used) != 0) {
+            return -1;
+        }
+        people += formatted;
+        count -= formatted;
+    }
+    return 0;
+}
+
+/**
+A binary file of people which is loaded with mmap and read in place, 
+nothing is parsed or allocated per record: 
+
+    struct PersonFileHeader      magic, version, count, where the names are
+    struct PersonFileRecord[]    count fixed size records
+    names                        every name '\0' terminated, records point into it by offset
+
+Numbers are stored in the byte order of the machine which wrote the file, 
+the magic check rejects a file from a machine with the other byte order. 
+PersonView_open maps a file and checks its header, a PersonView then gives 
+the records and their names straight out of the mapping until PersonView_close.
+*/
+
+#define PERSON_FILE_MAGIC 0x4e535250u  // "PRSN"
+#define PERSON_FILE_VERSION 1
+
+struct PersonFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t names_offset;  // from the start of the file
+    uint64_t names_size;
+};
+
+struct PersonFileRecord {
+    uint64_t name_offset;   // from the start of the names
+    uint32_t name_length;   // without the '\0'
+    int32_t age;
+    int32_t height;
+    int32_t weight;
+};
+
+struct PersonView {
+    void *base;
+    size_t size;
+    const struct PersonFileHeader *header;
+    const struct PersonFileRecord *records;
+    const char *names;
+};
+
+int PersonFile_write_header(FILE *file, uint64_t count, uint64_t names_size)
+{
+    struct PersonFileHeader header;
+
+    header.magic = PERSON_FILE_MAGIC;
+    header.version = PERSON_FILE_VERSION;
+    header.count = count;
+    header.names_offset = sizeof(struct PersonFileHeader)
+        + count * sizeof(struct PersonFileRecord);
+    header.names_size = names_size;
+
+    return fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+int PersonFile_write_record(FILE *file, uint64_t name_offset, size_t name_length,
+        int age, int height, int weight)
+{
+    struct PersonFileRecord record;
+
+    record.name_offset = name_offset;
+    record.name_length = (uint32_t)name_length;
+    record.age = age;
+    record.height = height;
+    record.weight = weight;
+
+    return fwrite(&record, sizeof(record), 1, file) == 1 ? 0 : -1;
+}
+
+int PersonFile_close(FILE *file, int result)
+{
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int PersonFile_write(const char *path, struct Person **people, size_t count)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    uint64_t names_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        names_size += strlen(people[i]->name) + 1;
+    }
+    if (PersonFile_write_header(file, count, names_size) != 0) {
+        return PersonFile_close(file, -1);
+    }
+
+    uint64_t name_offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t name_length = strlen(people[i]->name);
+        if (PersonFile_write_record(file, name_offset, name_length,
+                    people[i]->age, people[i]->height, people[i]->weight) != 0) {
+            return PersonFile_close(file, -1);
+        }
+        name_offset += name_length + 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (fputs(people[i]->name, file) == EOF || fputc('\0', file) == EOF) {
+            return PersonFile_close(file, -1);
+        }
+    }
+
+    return PersonFile_close(file, 0);
+}
+
+// the name pool of the table is already in the file layout
+int PersonFile_write_table(const char *path, struct PersonTable *table)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (PersonFile_write_header(file, table->count, table->names_used) != 0) {
+        return PersonFile_close(file, -1);
+    }
+    for (size_t row = 0; row < table->count; row++) {
+        if (PersonFile_write_record(file, table->name_offsets[row],
+                    strlen(PersonTable_name(table, row)), table->ages[row],
+                    table->heights[row], table->weights[row]) != 0) {
+            return PersonFile_close(file, -1);
+        }
+    }
+    if (fwrite(table->names, 1, table->names_used, file) != table->names_used) {
+        return PersonFile_close(file, -1);
+    }
+
+    return PersonFile_close(file, 0);
+}
+
+int PersonView_open(struct PersonView *view, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct PersonFileHeader)) {
+        close(fd);
+        return -1;
+    }
+    view->size = st.st_size;
+    view->base = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // the mapping stays valid
+    if (view->base == MAP_FAILED) {
+        return -1;
+    }
+
+    // check the header once, so the records can be used without any checks
+    const struct PersonFileHeader *header = view->base;
+    uint64_t records_end = sizeof(struct PersonFileHeader)
+        + header->count * sizeof(struct PersonFileRecord);
+    if (header->magic != PERSON_FILE_MAGIC || header->version != PERSON_FILE_VERSION
+            || header->count > view->size / sizeof(struct PersonFileRecord)
+            || header->names_offset < records_end
+            || header->names_offset > view->size
+            || header->names_size > view->size - header->names_offset) {
+        munmap(view->base, view->size);
+        return -1;
+    }
+
+    view->header = header;
+    view->records = (const struct PersonFileRecord *)(header + 1);
+    view->names = (const char *)view->base + header->names_offset;
+
+    return 0;
+}
+
+void PersonView_close(struct PersonView *view)
+{
+    munmap(view->base, view->size);
+    view->base = NULL;
+}
+
+size_t PersonView_count(struct PersonView *view)
+{
+    return view->header->count;
+}
+
+const struct PersonFileRecord *PersonView_record(struct PersonView *view, size_t i)
+{
+    assert(i < view->header->count);
+    return &view->records[i];
+}
+
+// NULL if the record points outside of the names
+const char *PersonView_name(struct PersonView *view, size_t i)
+{
+    const struct PersonFileRecord *record = PersonView_record(view, i);
+
+    if (record->name_offset >= view->header->names_size
+            || record->name_length >= view->header->names_size - record->name_offset
+            || view->names[record->name_offset + record->name_length] != '\0') {
+        return NULL;
+    }
+    return view->names + record->name_offset;
+}
+
+void PersonView_print(struct PersonView *view, size_t i)
+{
+    const struct PersonFileRecord *record = PersonView_record(view, i);
+    const char *name = PersonView_name(view, i);
+
+    printf("Name: %s\n", name != NULL ? name : "(bad name)");
+    printf("\tAge: %d\n", record->age);
+    printf("\tHeight: %d\n", record->height);
+    printf("\tWeight: %d\n", record->weight);
+}
+
+/**
+The mmap file needs the whole dataset in one file with all its names known up front, 
+and an array of struct Person needs all of it on the heap. 
+A person stream is read and written in fixed size chunks instead, 
+so memory stays at two chunks however big the file is: 
+
+    struct PersonChunkHeader     magic, bytes used, number of records
+    struct PersonStreamRecord    age, height, weight, name length, name + '\0', padded to 4
+    ...                          as many records as fit, the rest of the chunk is zero
+
+Both directions are double buffered with an I/O thread: 
+PersonStream_read gives every record of chunk N to the callback while the thread reads chunk N + 1, 
+and the thread writes chunk N of a PersonStreamWriter while the caller fills chunk N + 1. 
+A record (so a name) has to fit into one chunk.
+*/
+
+#define PERSON_STREAM_MAGIC 0x4b435250u  // "PRCK"
+#define PERSON_STREAM_CHUNK (64 * 1024)
+
+struct PersonChunkHeader {
+    uint32_t magic;
+    uint32_t used;     // bytes, header included
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct PersonStreamRecord {
+    int32_t age;
+    int32_t height;
+    int32_t weight;
+    uint32_t name_length;  // without the '\0'
+    char name[];
+};
+
+// two chunk buffers passed back and forth between the caller and the I/O thread
+struct PersonStreamBuffers {
+    char *chunks[2];
+    size_t sizes[2];
+    int full[2];
+    int finished;   // no more chunks will be filled
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    int fd;
+};
+
+void PersonStreamBuffers_init(struct PersonStreamBuffers *buffers, int fd)
+{
+    for (int i = 0; i < 2; i++) {
+        buffers->chunks[i] = malloc(PERSON_STREAM_CHUNK);
+        assert(buffers->chunks[i] != NULL);
+        buffers->sizes[i] = 0;
+        buffers->full[i] = 0;
+    }
+    buffers->finished = 0;
+    buffers->failed = 0;
+    buffers->fd = fd;
+    pthread_mutex_init(&buffers->lock, NULL);
+    pthread_cond_init(&buffers->changed, NULL);
+}
+
+void PersonStreamBuffers_free(struct PersonStreamBuffers *buffers)
+{
+    free(buffers->chunks[0]);
+    free(buffers->chunks[1]);
+    pthread_mutex_destroy(&buffers->lock);
+    pthread_cond_destroy(&buffers->changed);
+}
+
+// wait until chunk i is empty, 0 if the other side is finished
+int PersonStreamBuffers_wait_empty(struct PersonStreamBuffers *buffers, int i)
+{
+    pthread_mutex_lock(&buffers->lock);
+    while (buffers->full[i] && !buffers->failed) {
+        pthread_cond_wait(&buffers->changed, &buffers->lock);
+    }
+    int ok = !buffers->failed;
+    pthread_mutex_unlock(&buffers->lock);
+    return ok;
+}
+
+// wait until chunk i is full, 0 when there are no more chunks
+int PersonStreamBuffers_wait_full(struct PersonStreamBuffers *buffers, int i)
+{
+    pthread_mutex_lock(&buffers->lock);
+    while (!buffers->full[i] && !buffers->finished && !buffers->failed) {
+        pthread_cond_wait(&buffers->changed, &buffers->lock);
+    }
+    int ok = buffers->full[i] && !buffers->failed;
+    pthread_mutex_unlock(&buffers->lock);
+    return ok;
+}
+
+void PersonStreamBuffers_set(struct PersonStreamBuffers *buffers, int i,
+        int full, int finished, int failed)
+{
+    pthread_mutex_lock(&buffers->lock);
+    buffers->full[i] = full;
+    buffers->finished |= finished;
+    buffers->failed |= failed;
+    pthread_cond_broadcast(&buffers->changed);
+    pthread_mutex_unlock(&buffers->lock);
+}
+
+ssize_t PersonStream_read_all(int fd, char *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+void *PersonStream_reader_thread(void *arg)
+{
+    struct PersonStreamBuffers *buffers = arg;
+
+    for (int i = 0; PersonStreamBuffers_wait_empty(buffers, i); i ^= 1) {
+        ssize_t n = PersonStream_read_all(buffers->fd, buffers->chunks[i], PERSON_STREAM_CHUNK);
+        if (n == 0) {
+            PersonStreamBuffers_set(buffers, i, 0, 1, 0);
+            break;
+        }
+        if (n != PERSON_STREAM_CHUNK) {
+            PersonStreamBuffers_set(buffers, i, 0, 1, 1);  // error or cut off chunk
+            break;
+        }
+        buffers->sizes[i] = n;
+        PersonStreamBuffers_set(buffers, i, 1, 0, 0);
+    }
+    return NULL;
+}
+
+size_t PersonStreamRecord_size(size_t name_length)
+{
+    return (sizeof(struct PersonStreamRecord) + name_length + 1 + 3) & ~(size_t)3;
+}
+
+// calls fn for every record of one chunk, -1 if the chunk is damaged
+int PersonStream_parse_chunk(const char *chunk,
+        void (*fn)(const struct PersonStreamRecord *record, void *context), void *context)
+{
+    const struct PersonChunkHeader *header = (const struct PersonChunkHeader *)chunk;
+    size_t offset = sizeof(struct PersonChunkHeader);
+
+    if (header->magic != PERSON_STREAM_MAGIC || header->used < sizeof(struct PersonChunkHeader)
+            || header->used > PERSON_STREAM_CHUNK) {
+        return -1;
+    }
+    // only additions, offset may be a few padding bytes past used after the last record
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (offset + sizeof(struct PersonStreamRecord) > header->used) {
+            return -1;
+        }
+        const struct PersonStreamRecord *record =
+            (const struct PersonStreamRecord *)(chunk + offset);
+        if (record->name_length >= PERSON_STREAM_CHUNK
+                || offset + PersonStreamRecord_size(record->name_length) > header->used
+                || record->name[record->name_length] != '\0') {
+            return -1;
+        }
+        fn(record, context);
+        offset += PersonStreamRecord_size(record->name_length);
+    }
+    return 0;
+}
+
+int PersonStream_read(const char *path,
+        void (*fn)(const struct PersonStreamRecord *record, void *context), void *context)
+{
+    struct PersonStreamBuffers buffers;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    PersonStreamBuffers_init(&buffers, fd);
+    if (pthread_create(&buffers.thread, NULL, PersonStream_reader_thread, &buffers) != 0) {
+        PersonStreamBuffers_free(&buffers);
+        close(fd);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; PersonStreamBuffers_wait_full(&buffers, i); i ^= 1) {
+        if (PersonStream_parse_chunk(buffers.chunks[i], fn, context) != 0) {
+            result = -1;
+            PersonStreamBuffers_set(&buffers, i, 0, 1, 1);  // stops the reader
+            break;
+        }
+        PersonStreamBuffers_set(&buffers, i, 0, 0, 0);  // the reader may refill it
+    }
+
+    pthread_join(buffers.thread, NULL);
+    if (buffers.failed) {
+        result = -1;
+    }
+    PersonStreamBuffers_free(&buffers);
+    close(fd);
+    return result;
+}
+
+struct PersonStreamWriter {
+    struct PersonStreamBuffers buffers;
+    int current;       // chunk being filled by the caller
+    size_t used;
+    uint32_t count;
+};
+
+void *PersonStream_writer_thread(void *arg)
+{
+    struct PersonStreamBuffers *buffers = arg;
+
+    for (int i = 0; PersonStreamBuffers_wait_full(buffers, i); i ^= 1) {
+        if (Person_write_all(buffers->fd, buffers->chunks[i], buffers->sizes[i]) != 0) {
+            PersonStreamBuffers_set(buffers, i, 0, 1, 1);
+            break;
+        }
+        PersonStreamBuffers_set(buffers, i, 0, 0, 0);
+    }
+    return NULL;
+}
+
+struct PersonStreamWriter *PersonStreamWriter_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct PersonStreamWriter *writer = malloc(sizeof(struct PersonStreamWriter));
+    assert(writer != NULL);
+
+    PersonStreamBuffers_init(&writer->buffers, fd);
+    if (pthread_create(&writer->buffers.thread, NULL,
+                PersonStream_writer_thread, &writer->buffers) != 0) {
+        PersonStreamBuffers_free(&writer->buffers);
+        free(writer);
+        close(fd);
+        return NULL;
+    }
+    writer->current = 0;
+    writer->used = sizeof(struct PersonChunkHeader);
+    writer->count = 0;
+
+    return writer;
+}
+
+// hand the current chunk to the I/O thread and start filling the other one
+int PersonStreamWriter_flush(struct PersonStreamWriter *writer)
+{
+    struct PersonStreamBuffers *buffers = &writer->buffers;
+    char *chunk = buffers->chunks[writer->current];
+    struct PersonChunkHeader *header = (struct PersonChunkHeader *)chunk;
+
+    header->magic = PERSON_STREAM_MAGIC;
+    header->used = (uint32_t)writer->used;
+    header->count = writer->count;
+    header->reserved = 0;
+    memset(chunk + writer->used, 0, PERSON_STREAM_CHUNK - writer->used);
+    buffers->sizes[writer->current] = PERSON_STREAM_CHUNK;
+    PersonStreamBuffers_set(buffers, writer->current, 1, 0, 0);
+
+    writer->current ^= 1;
+    writer->used = sizeof(struct PersonChunkHeader);
+    writer->count = 0;
+    return PersonStreamBuffers_wait_empty(buffers, writer->current) ? 0 : -1;
+}
+
+int PersonStreamWriter_add(struct PersonStreamWriter *writer,
+        char *name, int age, int height, int weight)
+{
+    size_t name_length = strlen(name);
+    size_t size = PersonStreamRecord_size(name_length);
+
+    if (size > PERSON_STREAM_CHUNK - sizeof(struct PersonChunkHeader)) {
+        return -1;
+    }
+    if (writer->used + size > PERSON_STREAM_CHUNK && PersonStreamWriter_flush(writer) != 0) {
+        return -1;
+    }
+
+    struct PersonStreamRecord *record = (struct PersonStreamRecord *)
+        (writer->buffers.chunks[writer->current] + writer->used);
+    record->age = age;
+    record->height = height;
+    record->weight = weight;
+    record->name_length = (uint32_t)name_length;
+    memcpy(record->name, name, name_length + 1);
+    writer->used += size;
+    writer->count++;
+
+    return 0;
+}
+
+int PersonStreamWriter_close(struct PersonStreamWriter *writer)
+{
+    struct PersonStreamBuffers *buffers = &writer->buffers;
+    int result = 0;
+
+    if (writer->count > 0 && PersonStreamWriter_flush(writer) != 0) {
+        result = -1;
+    }
+    PersonStreamBuffers_set(buffers, writer->current, 0, 1, 0);
+    pthread_join(buffers->thread, NULL);
+    if (buffers->failed || close(buffers->fd) != 0) {
+        result = -1;
+    }
+    PersonStreamBuffers_free(buffers);
+    free(writer);
+    return result;
+}
+
+void Person_print_record(const struct PersonStreamRecord *record, void *context)
+{
+    (void)context;
+    printf("Name: %s\n", record->name);
+    printf("\tAge: %d\n", record->age);
+    printf("\tHeight: %d\n", record->height);
+    printf("\tWeight: %d\n", record->weight);
+}
+
 /**
-In this exercise you'll learn how to make a struct,
-point a pointer at them, and use them to make sense of internal memory structures.
+PersonBatch_create makes a whole batch of persons from an array of PersonInit on several threads, 
+and PersonBatch_destroy throws the batch away on several threads again. 
+Every worker allocates from a PersonArena of its own, so the workers never share an allocator, 
+and destroying the batch is freeing the arenas' chunks, one arena per worker. 
+Person_destroy_all does the same for an array of persons made one by one with Person_create. 
+
+The work is split with work stealing (PersonPool_run): every worker starts with an equal range of indexes 
+and takes PERSON_POOL_GRAIN of them at a time from the front of its range. 
+A worker which runs out steals the back half of the range of another one, 
+so a slow worker (a core busy with something else) does not hold up the batch. 
+A range is a begin and an end packed into one 64 bit word, 
+changed with compare and swap by its owner and by thieves alike. 
+Each range has a cache line of its own, so workers do not slow each other down by sharing one. 
+Indexes are 32 bits, a batch has at most UINT32_MAX persons.
 */
+#define PERSON_POOL_GRAIN 256
 
-struct Person {
+struct PersonInit {
     char *name;
     int age;
     int height;
     int weight;
 };
 
-struct Person *Person_create(char *name, int age, int height, int weight)
+struct PersonPoolRange {
+    uint64_t range;  // begin << 32 | end
+    char pad[64 - sizeof(uint64_t)];
+};
+
+struct PersonPool {
+    struct PersonPoolRange *ranges;
+    int workers;
+    size_t grain;
+    void (*fn)(int worker, size_t begin, size_t end, void *context);
+    void *context;
+};
+
+struct PersonPoolThread {
+    struct PersonPool *pool;
+    int worker;
+};
+
+uint64_t PersonPool_pack(size_t begin, size_t end)
 {
-    struct Person *who = malloc(sizeof(struct Person));
-    assert(who != NULL);
+    return ((uint64_t)begin << 32) | end;
+}
 
-    who->name = strdup(name);
-    who->age = age;
-    who->height = height;
-    who->weight = weight;
+int PersonPool_take(struct PersonPool *pool, int worker, size_t *begin, size_t *end)
+{
+    uint64_t *range = &pool->ranges[worker].range;
+    uint64_t value = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        size_t b = value >> 32;
+        size_t e = value & 0xffffffff;
+        if (b == e) {
+            return 0;
+        }
+        size_t next = e - b > pool->grain ? b + pool->grain : e;
+        if (__atomic_compare_exchange_n(range, &value, PersonPool_pack(next, e),
+                    1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *begin = b;
+            *end = next;
+            return 1;
+        }
+    }
+}
 
-    return who;
+int PersonPool_steal(struct PersonPool *pool, int worker)
+{
+    for (int i = 1; i < pool->workers; i++) {
+        int victim = (worker + i) % pool->workers;
+        uint64_t *range = &pool->ranges[victim].range;
+        uint64_t value = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+        for (;;) {
+            size_t b = value >> 32;
+            size_t e = value & 0xffffffff;
+            if (e - b < 2 * pool->grain) {
+                break;  // not worth it, the owner is almost done
+            }
+            size_t middle = b + (e - b) / 2;
+            if (__atomic_compare_exchange_n(range, &value, PersonPool_pack(b, middle),
+                        1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                // our range is empty, nobody else changes it
+                __atomic_store_n(&pool->ranges[worker].range,
+                        PersonPool_pack(middle, e), __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
-void Person_destroy(struct Person *who)
+void *PersonPool_worker(void *arg)
 {
-    assert(who != NULL);
+    struct PersonPoolThread *thread = arg;
+    struct PersonPool *pool = thread->pool;
+    size_t begin, end;
 
-    free(who->name);
-    free(who);
+    do {
+        while (PersonPool_take(pool, thread->worker, &begin, &end)) {
+            pool->fn(thread->worker, begin, end, pool->context);
+        }
+    } while (PersonPool_steal(pool, thread->worker));
+
+    return NULL;
 }
 
-void Person_print(struct Person *who)
+int PersonPool_threads(int threads)
 {
-    printf("Name: %s\n", who->name);
-    printf("\tAge: %d\n", who->age);
-    printf("\tHeight: %d\n", who->height);
-    printf("\tWeight: %d\n", who->weight);
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    return threads;
+}
+
+// calls fn for every index range of [0, count), on threads workers (the caller is worker 0)
+void PersonPool_run(size_t count, int threads, size_t grain,
+        void (*fn)(int worker, size_t begin, size_t end, void *context), void *context)
+{
+    assert(count <= UINT32_MAX && threads > 0);
+
+    struct PersonPool pool;
+    pool.ranges = malloc(threads * sizeof(struct PersonPoolRange));
+    struct PersonPoolThread *workers = malloc(threads * sizeof(struct PersonPoolThread));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    assert(pool.ranges != NULL && workers != NULL && ids != NULL);
+    pool.workers = threads;
+    pool.grain = grain;
+    pool.fn = fn;
+    pool.context = context;
+
+    for (int i = 0; i < threads; i++) {
+        pool.ranges[i].range = PersonPool_pack(count * i / threads, count * (i + 1) / threads);
+        workers[i].pool = &pool;
+        workers[i].worker = i;
+    }
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], NULL, PersonPool_worker, &workers[started]) != 0) {
+            break;  // the others steal the ranges of the workers which did not start
+        }
+    }
+    PersonPool_worker(&workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    // a range still left is one whose worker did not start, and nobody stole from it at the end
+    for (int i = started; i < threads; i++) {
+        PersonPool_worker(&workers[i]);
+    }
+
+    free(ids);
+    free(workers);
+    free(pool.ranges);
+}
+
+struct PersonBatch {
+    struct Person **people;     // people[i] was made from init[i]
+    size_t count;
+    struct PersonArena **arenas; // one per worker, NULL if the worker made nobody
+    int workers;
+};
+
+struct PersonBatchCreate {
+    struct PersonBatch *batch;
+    const struct PersonInit *init;
+};
+
+void PersonBatch_create_range(int worker, size_t begin, size_t end, void *context)
+{
+    struct PersonBatchCreate *create = context;
+    struct PersonBatch *batch = create->batch;
+
+    // made by the worker itself, so its chunks come from the worker's side of malloc
+    if (batch->arenas[worker] == NULL) {
+        batch->arenas[worker] = PersonArena_create(64 * 1024);
+    }
+    for (size_t i = begin; i < end; i++) {
+        const struct PersonInit *init = &create->init[i];
+        batch->people[i] = PersonArena_alloc_person(batch->arenas[worker],
+                init->name, init->age, init->height, init->weight);
+    }
+}
+
+struct PersonBatch *PersonBatch_create(const struct PersonInit *init, size_t count, int threads)
+{
+    struct PersonBatch *batch = malloc(sizeof(struct PersonBatch));
+    assert(batch != NULL);
+
+    batch->workers = PersonPool_threads(threads);
+    batch->count = count;
+    batch->people = malloc(count * sizeof(struct Person *));
+    batch->arenas = calloc(batch->workers, sizeof(struct PersonArena *));
+    assert(batch->people != NULL && batch->arenas != NULL);
+
+    struct PersonBatchCreate create = { batch, init };
+    PersonPool_run(count, batch->workers, PERSON_POOL_GRAIN, PersonBatch_create_range, &create);
+
+    return batch;
+}
+
+void PersonBatch_destroy_range(int worker, size_t begin, size_t end, void *context)
+{
+    struct PersonBatch *batch = context;
+
+    (void)worker;
+    for (size_t i = begin; i < end; i++) {
+        if (batch->arenas[i] != NULL) {
+            PersonArena_destroy(batch->arenas[i]);
+        }
+    }
+}
+
+void PersonBatch_destroy(struct PersonBatch *batch)
+{
+    assert(batch != NULL);
+
+    PersonPool_run(batch->workers, batch->workers, 1, PersonBatch_destroy_range, batch);
+    free(batch->arenas);
+    free(batch->people);
+    free(batch);
+}
+
+void Person_destroy_range(int worker, size_t begin, size_t end, void *context)
+{
+    struct Person **people = context;
+
+    (void)worker;
+    for (size_t i = begin; i < end; i++) {
+        Person_destroy(people[i]);
+    }
+}
+
+void Person_destroy_all(struct Person **people, size_t count, int threads)
+{
+    PersonPool_run(count, PersonPool_threads(threads), PERSON_POOL_GRAIN,
+            Person_destroy_range, people);
+}
+
+/**
+PersonIndex finds the row of a person by name without scanning the table. 
+It is an open addressing hash table split into shards, the hash of a name picks the shard. 
+Lookups take no lock at all and writers only lock the shard they change, 
+so writers to different shards do not wait for each other. 
+
+A bucket is one cache line: 7 slots, each with a pointer to an entry (the name, its hash and its row), 
+and an 8 byte word with a one byte tag per slot, taken from the top of the hash 
+(0 is a free slot and 1 a removed one). A lookup loads the tag word of a bucket with one atomic load 
+and compares all tags at once (SSE2, or a loop where there is none), 
+only the slots with the right tag are loaded (acquire) and compared by hash and name. 
+Probing goes on to the next bucket of the shard until a bucket with a free slot. 
+
+Writers publish a new entry before its tag, so a reader which sees the tag sees the entry. 
+Entries live in an arena per shard and PersonIndex_remove does not free them, 
+so a lookup can still read an entry which is being removed at the same time. 
+A removed slot becomes free again at once when its bucket has a free slot already 
+(lookups stop at that bucket anyway), else it stays a tombstone until an insert takes it. 
+So every insert of a new name costs arena memory and removed entries pile up there: 
+PersonIndex_compact rebuilds the shards where they pass a quarter of the slots, 
+with fresh buckets and only the live entries, and frees the old ones. 
+It must not run while anybody calls PersonIndex_find, call it where the readers are quiet. 
+The capacity is fixed at create time, PersonIndex_insert fails once a shard is full.
+*/
+#define PERSON_INDEX_WAYS 7
+#define PERSON_INDEX_FREE 0
+#define PERSON_INDEX_REMOVED 1
+#define PERSON_INDEX_DEAD_LIMIT 4   // compact once dead entries pass 1/4 of the slots
+
+struct PersonIndexEntry {
+    uint64_t hash;
+    uint32_t row;     // changed in place, with atomic stores
+    char name[];
+};
+
+struct PersonIndexBucket {
+    uint64_t tags;    // byte i is the tag of slot i, byte 7 is always free
+    struct PersonIndexEntry *entries[PERSON_INDEX_WAYS];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct PersonIndexBucket) == 64, "a bucket is one cache line");
+
+struct PersonIndexShard {
+    pthread_mutex_t lock;           // writers only
+    struct PersonIndexBucket *buckets;
+    size_t mask;                    // buckets - 1
+    struct PersonArena *entries;
+    size_t removed;                 // slots tagged removed
+    size_t dead;                    // entries in the arena no slot points to
+} __attribute__((aligned(64)));
+
+struct PersonIndex {
+    struct PersonIndexShard *shards;
+    size_t shard_mask;
+};
+
+uint64_t PersonIndex_hash(const char *name)
+{
+    // FNV-1a, and a final mix so all the bits depend on every byte
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+uint8_t PersonIndex_tag(uint64_t hash)
+{
+    uint8_t tag = hash >> 56;
+    return tag < 2 ? tag + 2 : tag;
+}
+
+// bit i is set where slot i has tag
+unsigned PersonIndex_match(uint64_t tags, uint8_t tag)
+{
+#if defined(__SSE2__) && defined(__x86_64__)
+    __m128i equal = _mm_cmpeq_epi8(_mm_cvtsi64_si128((long long)tags), _mm_set1_epi8((char)tag));
+    return (unsigned)_mm_movemask_epi8(equal) & ((1u << PERSON_INDEX_WAYS) - 1);
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < PERSON_INDEX_WAYS; i++) {
+        if (((tags >> (8 * i)) & 0xff) == tag) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+size_t PersonIndex_round(size_t n)
+{
+    size_t power = 1;
+    while (power < n) {
+        power *= 2;
+    }
+    return power;
+}
+
+// room for capacity names in all, shards is rounded up to a power of two (0 means 16)
+struct PersonIndex *PersonIndex_create(size_t capacity, int shards)
+{
+    struct PersonIndex *index = malloc(sizeof(struct PersonIndex));
+    assert(index != NULL);
+
+    size_t shard_count = PersonIndex_round(shards > 0 ? (size_t)shards : 16);
+    // buckets a bit more than half full at most, so probes stay short
+    size_t buckets = PersonIndex_round((capacity * 2 / shard_count + PERSON_INDEX_WAYS - 1) / PERSON_INDEX_WAYS);
+    int result = posix_memalign((void **)&index->shards, 64, shard_count * sizeof(struct PersonIndexShard));
+    assert(result == 0);
+
+    index->shard_mask = shard_count - 1;
+    for (size_t i = 0; i < shard_count; i++) {
+        struct PersonIndexShard *shard = &index->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        result = posix_memalign((void **)&shard->buckets, 64, buckets * sizeof(struct PersonIndexBucket));
+        assert(result == 0);
+        memset(shard->buckets, 0, buckets * sizeof(struct PersonIndexBucket));
+        shard->mask = buckets - 1;
+        shard->entries = PersonArena_create(4096);
+        shard->removed = 0;
+        shard->dead = 0;
+    }
+
+    return index;
+}
+
+void PersonIndex_destroy(struct PersonIndex *index)
+{
+    assert(index != NULL);
+
+    for (size_t i = 0; i <= index->shard_mask; i++) {
+        pthread_mutex_destroy(&index->shards[i].lock);
+        free(index->shards[i].buckets);
+        PersonArena_destroy(index->shards[i].entries);
+    }
+    free(index->shards);
+    free(index);
+}
+
+struct PersonIndexShard *PersonIndex_shard(struct PersonIndex *index, uint64_t hash)
+{
+    return &index->shards[hash & index->shard_mask];
+}
+
+// the entry of name, NULL if there is none, safe without the lock
+struct PersonIndexEntry *PersonIndex_lookup(struct PersonIndexShard *shard,
+        const char *name, uint64_t hash)
+{
+    uint8_t tag = PersonIndex_tag(hash);
+    size_t b = (hash >> 16) & shard->mask;
+
+    for (size_t probes = 0; probes <= shard->mask; probes++) {
+        struct PersonIndexBucket *bucket = &shard->buckets[b];
+        uint64_t tags = __atomic_load_n(&bucket->tags, __ATOMIC_ACQUIRE);
+        for (unsigned match = PersonIndex_match(tags, tag); match != 0; match &= match - 1) {
+            struct PersonIndexEntry *entry =
+                __atomic_load_n(&bucket->entries[__builtin_ctz(match)], __ATOMIC_ACQUIRE);
+            if (entry != NULL && entry->hash == hash && strcmp(entry->name, name) == 0) {
+                return entry;
+            }
+        }
+        if (PersonIndex_match(tags, PERSON_INDEX_FREE) != 0) {
+            return NULL;  // name would have gone here
+        }
+        b = (b + 1) & shard->mask;
+    }
+    return NULL;
+}
+
+// 1 and the row of name, 0 if name is not in the index, takes no lock
+int PersonIndex_find(struct PersonIndex *index, const char *name, uint32_t *row)
+{
+    uint64_t hash = PersonIndex_hash(name);
+    struct PersonIndexEntry *entry = PersonIndex_lookup(PersonIndex_shard(index, hash), name, hash);
+    if (entry == NULL) {
+        return 0;
+    }
+    *row = __atomic_load_n(&entry->row, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void PersonIndex_set_tag(struct PersonIndexBucket *bucket, int slot, uint8_t tag)
+{
+    uint64_t tags = bucket->tags;  // only writers change it, and we hold the lock
+    tags &= ~(0xffULL << (8 * slot));
+    tags |= (uint64_t)tag << (8 * slot);
+    __atomic_store_n(&bucket->tags, tags, __ATOMIC_RELEASE);
+}
+
+// the first free or removed slot on the way from the bucket of hash, -1 if the shard is full
+int PersonIndex_open(struct PersonIndexShard *shard, uint64_t hash, struct PersonIndexBucket **bucket)
+{
+    size_t b = (hash >> 16) & shard->mask;
+    for (size_t probes = 0; probes <= shard->mask; probes++) {
+        *bucket = &shard->buckets[b];
+        unsigned open = PersonIndex_match((*bucket)->tags, PERSON_INDEX_FREE) |
+                PersonIndex_match((*bucket)->tags, PERSON_INDEX_REMOVED);
+        if (open != 0) {
+            return __builtin_ctz(open);
+        }
+        b = (b + 1) & shard->mask;
+    }
+    return -1;
+}
+
+// puts entry into slot and makes it visible, the shard is locked
+void PersonIndex_publish(struct PersonIndexShard *shard, struct PersonIndexBucket *bucket,
+        int slot, struct PersonIndexEntry *entry)
+{
+    if (((bucket->tags >> (8 * slot)) & 0xff) == PERSON_INDEX_REMOVED) {
+        shard->removed--;
+    }
+    // the entry first, then the tag which makes readers look at it
+    __atomic_store_n(&bucket->entries[slot], entry, __ATOMIC_RELEASE);
+    PersonIndex_set_tag(bucket, slot, PersonIndex_tag(entry->hash));
+}
+
+struct PersonIndexEntry *PersonIndex_new_entry(struct PersonArena *arena,
+        const char *name, uint64_t hash, uint32_t row)
+{
+    size_t name_size = strlen(name) + 1;
+    struct PersonIndexEntry *entry =
+        PersonArena_alloc(arena, sizeof(struct PersonIndexEntry) + name_size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->row = row;
+    memcpy(entry->name, name, name_size);
+    return entry;
+}
+
+// adds name, or moves it to row if it is there already, -1 if the shard is full or out of memory
+int PersonIndex_insert(struct PersonIndex *index, const char *name, uint32_t row)
+{
+    uint64_t hash = PersonIndex_hash(name);
+    struct PersonIndexShard *shard = PersonIndex_shard(index, hash);
+    int result = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    struct PersonIndexEntry *entry = PersonIndex_lookup(shard, name, hash);
+    if (entry != NULL) {
+        __atomic_store_n(&entry->row, row, __ATOMIC_RELAXED);
+        result = 0;
+    } else {
+        struct PersonIndexBucket *bucket;
+        int slot = PersonIndex_open(shard, hash, &bucket);
+        if (slot >= 0 && (entry = PersonIndex_new_entry(shard->entries, name, hash, row)) != NULL) {
+            PersonIndex_publish(shard, bucket, slot, entry);
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
+}
+
+// 0 if name was removed, -1 if it was not there
+int PersonIndex_remove(struct PersonIndex *index, const char *name)
+{
+    uint64_t hash = PersonIndex_hash(name);
+    struct PersonIndexShard *shard = PersonIndex_shard(index, hash);
+    int result = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    struct PersonIndexEntry *entry = PersonIndex_lookup(shard, name, hash);
+    if (entry != NULL) {
+        size_t b = (hash >> 16) & shard->mask;
+        for (;;) {
+            struct PersonIndexBucket *bucket = &shard->buckets[b];
+            for (int slot = 0; slot < PERSON_INDEX_WAYS; slot++) {
+                if (bucket->entries[slot] == entry) {
+                    // the entry stays, a reader may still be looking at it. 
+                    // The slot may be free if another one of the bucket is: 
+                    // then no name behind this bucket ever probed through it
+                    if (PersonIndex_match(bucket->tags, PERSON_INDEX_FREE) != 0) {
+                        PersonIndex_set_tag(bucket, slot, PERSON_INDEX_FREE);
+                    } else {
+                        PersonIndex_set_tag(bucket, slot, PERSON_INDEX_REMOVED);
+                        shard->removed++;
+                    }
+                    shard->dead++;
+                    result = 0;
+                }
+            }
+            if (result == 0) {
+                break;
+            }
+            b = (b + 1) & shard->mask;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return result;
+}
+
+// fresh buckets and a fresh arena with only the live entries, 
+// -1 and the shard as it was if there is no memory for them
+int PersonIndex_rebuild(struct PersonIndexShard *shard)
+{
+    size_t buckets = shard->mask + 1;
+    struct PersonIndexShard fresh;  // only the table, the lock stays in shard
+
+    if (posix_memalign((void **)&fresh.buckets, 64, buckets * sizeof(struct PersonIndexBucket)) != 0) {
+        return -1;
+    }
+    memset(fresh.buckets, 0, buckets * sizeof(struct PersonIndexBucket));
+    fresh.mask = shard->mask;
+    fresh.entries = PersonArena_create(4096);
+    fresh.removed = 0;
+    fresh.dead = 0;
+
+    // the same names fit again, there are only fewer of them
+    for (size_t b = 0; b < buckets; b++) {
+        struct PersonIndexBucket *old = &shard->buckets[b];
+        for (int slot = 0; slot < PERSON_INDEX_WAYS; slot++) {
+            uint8_t tag = (old->tags >> (8 * slot)) & 0xff;
+            if (tag == PERSON_INDEX_FREE || tag == PERSON_INDEX_REMOVED) {
+                continue;
+            }
+            struct PersonIndexEntry *entry = PersonIndex_new_entry(fresh.entries,
+                    old->entries[slot]->name, old->entries[slot]->hash, old->entries[slot]->row);
+            if (entry == NULL) {
+                free(fresh.buckets);
+                PersonArena_destroy(fresh.entries);
+                return -1;
+            }
+            struct PersonIndexBucket *bucket;
+            int open = PersonIndex_open(&fresh, entry->hash, &bucket);
+            assert(open >= 0);
+            PersonIndex_publish(&fresh, bucket, open, entry);
+        }
+    }
+
+    free(shard->buckets);
+    PersonArena_destroy(shard->entries);
+    shard->buckets = fresh.buckets;
+    shard->entries = fresh.entries;
+    shard->removed = 0;
+    shard->dead = 0;
+    return 0;
+}
+
+// rebuilds the shards whose dead entries passed the limit, returns how many. 
+// Not while anybody calls PersonIndex_find, the old entries are freed
+size_t PersonIndex_compact(struct PersonIndex *index)
+{
+    size_t rebuilt = 0;
+
+    for (size_t i = 0; i <= index->shard_mask; i++) {
+        struct PersonIndexShard *shard = &index->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        size_t slots = (shard->mask + 1) * PERSON_INDEX_WAYS;
+        if (shard->dead > slots / PERSON_INDEX_DEAD_LIMIT && PersonIndex_rebuild(shard) == 0) {
+            rebuilt++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return rebuilt;
+}
+
+// indexes every row of table, -1 if the index ran out of room
+int PersonIndex_add_table(struct PersonIndex *index, struct PersonTable *table)
+{
+    for (size_t row = 0; row < table->count; row++) {
+        if (PersonIndex_insert(index, PersonTable_name(table, row), (uint32_t)row) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+PersonBench_run measures creating and destroying persons four ways: 
+one by one with Person_create and Person_destroy (a short and a long name), 
+in an arena which is reset every 1024 persons, as a PersonBatch on every core, 
+and as rows of a PersonTable. It also measures looking persons up by name in a PersonIndex. 
+For each it prints the time per person, the allocations per person (Person_allocations, SP_BENCH only) 
+and the cache misses per person, counted by the CPU through perf_event_open. 
+Where there is no such counter (not Linux, or perf events not allowed) it prints n/a. 
+Run it before and after a change to see whether the change helps.
+*/
+
+struct PersonBench {
+    const char *name;
+    size_t ops;
+    size_t allocations;
+    struct timespec start;
+    int misses;           // perf event fd, -1 if there is none
+};
+
+void PersonBench_start(struct PersonBench *bench, const char *name, size_t ops)
+{
+    bench->name = name;
+    bench->ops = ops;
+    bench->misses = -1;
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1; // PersonBatch runs on worker threads, count their misses too
+    bench->misses = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+#ifdef SP_BENCH
+    bench->allocations = __atomic_load_n(&Person_allocations, __ATOMIC_RELAXED);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+void PersonBench_stop(struct PersonBench *bench)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - bench->start.tv_sec) * 1e9 + (end.tv_nsec - bench->start.tv_nsec);
+
+    printf("%-28s %8.2f ns/op ", bench->name, ns / bench->ops);
+#ifdef SP_BENCH
+    size_t allocations = __atomic_load_n(&Person_allocations, __ATOMIC_RELAXED) - bench->allocations;
+    printf("%5.2f allocs/op ", (double)allocations / bench->ops);
+#else
+    printf("allocs n/a ");
+#endif
+    uint64_t misses;
+    if (bench->misses >= 0 && read(bench->misses, &misses, sizeof(misses)) == sizeof(misses)) {
+        printf("%6.3f misses/op\n", (double)misses / bench->ops);
+    } else {
+        printf("misses n/a\n");
+    }
+    if (bench->misses >= 0) {
+        close(bench->misses);
+    }
+}
+
+void PersonBench_run(size_t ops)
+{
+    struct PersonBench bench;
+    char long_name[] = "Frank Blank of the Long Name Family";
+
+    PersonBench_start(&bench, "Person_create short name", ops);
+    for (size_t i = 0; i < ops; i++) {
+        Person_destroy(Person_create("Joe Alex", 32, 64, 140));
+    }
+    PersonBench_stop(&bench);
+
+    PersonBench_start(&bench, "Person_create long name", ops);
+    for (size_t i = 0; i < ops; i++) {
+        Person_destroy(Person_create(long_name, 20, 72, 180));
+    }
+    PersonBench_stop(&bench);
+
+    struct PersonArena *arena = PersonArena_create(64 * 1024);
+    PersonBench_start(&bench, "PersonArena_alloc_person", ops);
+    for (size_t i = 0; i < ops; i++) {
+        PersonArena_alloc_person(arena, "Joe Alex", 32, 64, 140);
+        if (i % 1024 == 1023) {
+            PersonArena_reset(arena);
+        }
+    }
+    PersonArena_reset(arena);
+    PersonBench_stop(&bench);
+    PersonArena_destroy(arena);
+
+    struct PersonInit *init = malloc(ops * sizeof(struct PersonInit));
+    assert(init != NULL);
+    for (size_t i = 0; i < ops; i++) {
+        struct PersonInit joe = { "Joe Alex", 32, 64, 140 };
+        init[i] = joe;
+    }
+    PersonBench_start(&bench, "PersonBatch_create/destroy", ops);
+    PersonBatch_destroy(PersonBatch_create(init, ops, 0));
+    PersonBench_stop(&bench);
+    free(init);
+
+    PersonBench_start(&bench, "PersonTable_add", ops);
+    struct PersonTable *table = PersonTable_create(0);
+    for (size_t i = 0; i < ops; i++) {
+        PersonTable_add(table, "Joe Alex", 32, 64, 140);
+    }
+    PersonTable_destroy(table);
+    PersonBench_stop(&bench);
+
+    size_t names = ops < 65536 ? ops : 65536;
+    struct PersonTable *named = PersonTable_create(names);
+    char name[32];
+    for (size_t i = 0; i < names; i++) {
+        snprintf(name, sizeof(name), "Person %zu", i);
+        PersonTable_add(named, name, 32, 64, 140);
+    }
+    struct PersonIndex *index = PersonIndex_create(names, 0);
+    PersonIndex_add_table(index, named);
+    size_t found = 0;
+    uint32_t row;
+    PersonBench_start(&bench, "PersonIndex_find", ops);
+    for (size_t i = 0; i < ops; i++) {
+        found += PersonIndex_find(index, PersonTable_name(named, i % names), &row);
+    }
+    PersonBench_stop(&bench);
+    printf("found %zu of %zu\n", found, ops);
+    PersonIndex_destroy(index);
+    PersonTable_destroy(named);
 }
 
 int main(int argc, char *argv[])
@@ -65,9 +2081,110 @@ int main(int argc, char *argv[])
     frank->weight += 20;
     Person_print(frank);
 
+    // print them both again with a single write
+    struct Person *people[] = { joe, frank };
+    char buf[4096];
+    fflush(stdout);
+    Person_write_batch(1, people, 2, buf, sizeof(buf));
+
     // destroy them both so we clean up
     Person_destroy(joe);
     Person_destroy(frank);
 
+    // make a batch of people in an arena and throw them all away at once
+    struct PersonArena *arena = PersonArena_create(4096);
+    struct Person *bob = PersonArena_alloc_person(arena,
+            "Bob Smith", 40, 70, 160);
+    struct Person *alice = PersonArena_alloc_person(arena,
+            "Alice Green", 35, 66, 130);
+
+    printf("Bob is at memory location %p:\n", bob);
+    Person_print(bob);
+
+    printf("Alice is at memory location %p:\n", alice);
+    Person_print(alice);
+
+    PersonArena_reset(arena);
+    PersonArena_destroy(arena);
+
+    // keep everyone in a table and age them all in one pass
+    struct PersonTable *table = PersonTable_create(0);
+    size_t joe_row = PersonTable_add(table, "Joe Alex", 32, 64, 140);
+    size_t frank_row = PersonTable_add(table, "Frank Blank", 20, 72, 180);
+
+    PersonTable_add_age(table, 20);
+    PersonTable_add_weight(table, 20);
+    PersonTable_print(table, joe_row);
+    PersonTable_print(table, frank_row);
+
+    // ask the table who is between 30 and 40 and how tall everyone is
+    uint64_t selected = 0;
+    struct PersonColumnStats heights;
+    PersonTable_filter_age(table, 30, 40, &selected);
+    PersonTable_column_stats(table->heights, table->count, &heights);
+    printf("Rows aged 30 to 40: %llx\n", (unsigned long long)selected);
+    printf("Height sum %lld min %d max %d\n", heights.sum, heights.min, heights.max);
+
+    // save the table to the file given on the command line and map it back
+    if (argc > 1 && PersonFile_write_table(argv[1], table) == 0) {
+        struct PersonView view;
+        if (PersonView_open(&view, argv[1]) == 0) {
+            for (size_t i = 0; i < PersonView_count(&view); i++) {
+                PersonView_print(&view, i);
+            }
+            PersonView_close(&view);
+        }
+    }
+
+    // stream them through a chunked file as well
+    if (argc > 2) {
+        struct PersonStreamWriter *writer = PersonStreamWriter_open(argv[2]);
+        if (writer != NULL) {
+            for (size_t row = 0; row < table->count; row++) {
+                PersonStreamWriter_add(writer, PersonTable_name(table, row),
+                        table->ages[row], table->heights[row], table->weights[row]);
+            }
+            if (PersonStreamWriter_close(writer) == 0) {
+                PersonStream_read(argv[2], Person_print_record, NULL);
+            }
+        }
+    }
+
+    // look Frank up by name
+    struct PersonIndex *index = PersonIndex_create(1024, 0);
+    uint32_t found;
+    PersonIndex_add_table(index, table);
+    if (PersonIndex_find(index, "Frank Blank", &found)) {
+        PersonTable_print(table, found);
+    }
+    // Frank leaves, his entry is freed once enough others are gone too
+    PersonIndex_remove(index, "Frank Blank");
+    PersonIndex_compact(index);
+    PersonIndex_destroy(index);
+
+    PersonTable_destroy(table);
+
+    // make a big batch on every core and throw it away again
+    struct PersonInit inits[] = {
+        { "Joe Alex", 32, 64, 140 },
+        { "Frank Blank", 20, 72, 180 },
+    };
+    size_t batch_count = 100000;
+    struct PersonInit *init = malloc(batch_count * sizeof(struct PersonInit));
+    assert(init != NULL);
+    for (size_t i = 0; i < batch_count; i++) {
+        init[i] = inits[i % 2];
+    }
+    struct PersonBatch *batch = PersonBatch_create(init, batch_count, 0);
+    printf("Batch of %zu, the last one is:\n", batch->count);
+    Person_print(batch->people[batch_count - 1]);
+    PersonBatch_destroy(batch);
+    free(init);
+
+    // the third argument asks for the benchmark, with that many persons per case
+    if (argc > 3) {
+        PersonBench_run(strtoul(argv[3], NULL, 10));
+    }
+
     return 0;
 }